@@ -13,6 +13,37 @@
 #include <tuple>
 #include <fstream>
 #include <filesystem>
+#include <string_view>
+#include <functional>
+#include <random>
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <thread>
+#include <unordered_map>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <cstring>
+#include <cstdint>
+#include <iomanip>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#include <cpuid.h>
+#endif
+
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <poll.h>
 
 using namespace std;
 
@@ -24,151 +55,2598 @@ const int screen_height = 800;
 unsigned int middle_x_screen = screen_width / 2;
 unsigned int middle_y_screen = screen_height / 2;
 
-bool should_break = false;
+atomic<bool> should_break = false;
 
 bool is_presenting = false;
 bool is_editting = false;
 
-Font font = GetFontDefault();
+// Nanoseconds since the session epoch. Every timestamp in the program (frame
+// onsets, key events, logs) is one of these.
+using session_time = chrono::duration<int64_t, nano>;
+
+// Single monotonic session clock. It reads steady_clock by default; after
+// calibrate_tsc() it reads the invariant TSC instead, scaled against
+// steady_clock, which keeps now() at a few nanoseconds in the frame loop.
+// About once a second the render thread's tick() re-anchors the TSC to
+// steady_clock: the rate is re-measured over everything since calibration
+// and the remaining error is slewed out over the next second, so readings
+// never jump and drift stays bounded over long sessions.
+class TimeBase
+{
+public:
+    chrono::steady_clock::time_point epoch = chrono::steady_clock::now();
+
+    bool use_tsc = false;
+
+    // Guarded like a marker slot: tick() makes anchor_lock odd while it
+    // rewrites the anchor, and readers retry if it was odd or moved.
+    struct Anchor
+    {
+        atomic<uint64_t> tsc = 0;
+        atomic<int64_t> ns = 0; // session time at tsc
+        atomic<double> ns_per_tick = 0;
+    };
+    Anchor anchor;
+    atomic<uint64_t> anchor_lock = 0;
+    uint64_t resync_ticks = 0;
+    uint64_t calibration_tsc = 0;
+    chrono::steady_clock::time_point calibration_time;
+    int64_t max_error_ns = 0; // largest TSC-vs-steady_clock difference seen; render thread only
+
+    session_time now()
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        if (this->use_tsc)
+        {
+            while (true)
+            {
+                uint64_t lock = this->anchor_lock.load(memory_order_acquire);
+                if (lock & 1)
+                    continue;
+                uint64_t anchor_tsc = this->anchor.tsc.load(memory_order_relaxed);
+                int64_t anchor_ns = this->anchor.ns.load(memory_order_relaxed);
+                double ns_per_tick = this->anchor.ns_per_tick.load(memory_order_relaxed);
+                // The TSC is read between the two lock loads, so a reading
+                // taken while the lock held is never newer than tick()'s.
+                _mm_lfence();
+                uint64_t tsc = __rdtsc();
+                _mm_lfence();
+                atomic_thread_fence(memory_order_acquire);
+                if (this->anchor_lock.load(memory_order_relaxed) == lock)
+                    return session_time(anchor_ns + (int64_t)((tsc - anchor_tsc) * ns_per_tick));
+            }
+        }
+#endif
+        return chrono::duration_cast<session_time>(chrono::steady_clock::now() - this->epoch);
+    }
+
+    bool calibrate_tsc(chrono::milliseconds window = chrono::milliseconds(50))
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        unsigned int eax, ebx, ecx, edx;
+        if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) || !(edx & (1 << 8)))
+        {
+            cerr << "TSC is not invariant on this CPU; keeping steady_clock." << endl;
+            return false;
+        }
+
+        auto t_start = chrono::steady_clock::now();
+        uint64_t tsc_start = __rdtsc();
+        auto t_end = t_start;
+        while (t_end - t_start < window)
+            t_end = chrono::steady_clock::now();
+        uint64_t tsc_end = __rdtsc();
+
+        double ns_per_tick = (double)chrono::duration_cast<chrono::nanoseconds>(t_end - t_start).count() / (tsc_end - tsc_start);
+        this->calibration_tsc = tsc_start;
+        this->calibration_time = t_start;
+        this->resync_ticks = (uint64_t)(1e9 / ns_per_tick);
+        this->anchor.tsc = tsc_start;
+        this->anchor.ns = chrono::duration_cast<session_time>(t_start - this->epoch).count();
+        this->anchor.ns_per_tick = ns_per_tick;
+        this->use_tsc = true;
+
+        cout << "TSC calibrated: " << 1 / ns_per_tick << " GHz" << endl;
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    // Render thread, once per frame: re-anchors when the anchor is a second old.
+    void tick()
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        if (!this->use_tsc || __rdtsc() - this->anchor.tsc.load(memory_order_relaxed) <= this->resync_ticks)
+            return;
+
+        // The odd lock is visible before the TSC is read.
+        uint64_t lock = this->anchor_lock.load(memory_order_relaxed);
+        this->anchor_lock.store(lock + 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+
+        uint64_t anchor_tsc = this->anchor.tsc.load(memory_order_relaxed);
+        int64_t anchor_ns = this->anchor.ns.load(memory_order_relaxed);
+        double ns_per_tick = this->anchor.ns_per_tick.load(memory_order_relaxed);
+        uint64_t tsc = __rdtsc();
+        auto steady = chrono::steady_clock::now();
+        int64_t ns = anchor_ns + (int64_t)((tsc - anchor_tsc) * ns_per_tick);
+
+        int64_t error = chrono::duration_cast<session_time>(steady - this->epoch).count() - ns;
+        this->max_error_ns = max(this->max_error_ns, (int64_t)llabs(error));
+
+        double rate = (double)chrono::duration_cast<chrono::nanoseconds>(steady - this->calibration_time).count() / (tsc - this->calibration_tsc);
+        this->anchor.tsc.store(tsc, memory_order_relaxed);
+        this->anchor.ns.store(ns, memory_order_relaxed);
+        this->anchor.ns_per_tick.store(max(rate / 2, rate + (double)error / this->resync_ticks), memory_order_relaxed);
+        this->anchor_lock.store(lock + 2, memory_order_release);
+#endif
+    }
+
+    static double to_ms(session_time t)
+    {
+        return chrono::duration<double, milli>(t).count();
+    }
+};
+
+TimeBase session_clock;
+
+// Counts the operator new calls made while a stimulus frame is presented on
+// the render thread or built on a builder thread, per frame and per call
+// site. Counting is compiled in with -DTRACK_ALLOCATIONS; raylib's own malloc
+// calls are not seen here.
+thread_local bool is_tracking_allocations = false;
+thread_local uint64_t tracked_count = 0;
+thread_local uint64_t tracked_bytes = 0;
+
+class AllocationTracker
+{
+public:
+    struct Site
+    {
+        void *address;
+        uint64_t count;
+        uint64_t bytes;
+    };
+
+    // Fixed open-addressed table: recording must not allocate itself. The
+    // render thread and the builders record into it, so it is guarded by a
+    // spin lock.
+    static const int site_capacity = 256;
+    Site sites[site_capacity] = {};
+    atomic_flag sites_lock = ATOMIC_FLAG_INIT;
+
+    struct Totals
+    {
+        uint64_t frames = 0;
+        uint64_t frames_allocating = 0;
+        uint64_t count = 0;
+        uint64_t bytes = 0;
+        uint64_t max_frame_count = 0;
+        uint64_t max_frame_bytes = 0;
+    };
+    Totals presented = {};
+    Totals built = {};
+
+    void record(void *address, size_t size)
+    {
+        tracked_count++;
+        tracked_bytes += size;
+
+        while (this->sites_lock.test_and_set(memory_order_acquire))
+            ;
+        size_t slot = ((uintptr_t)address >> 2) % site_capacity;
+        for (int probe = 0; probe < site_capacity; probe++)
+        {
+            Site &site = this->sites[(slot + probe) % site_capacity];
+            if (site.address == address || site.address == 0)
+            {
+                site.address = address;
+                site.count++;
+                site.bytes += size;
+                break;
+            }
+        }
+        this->sites_lock.clear(memory_order_release);
+    }
+
+    void begin_frame()
+    {
+        tracked_count = 0;
+        tracked_bytes = 0;
+        is_tracking_allocations = true;
+    }
+
+    void end_frame()
+    {
+        this->finish(&this->presented);
+    }
+
+    // The same around building one frame on the builder thread.
+    void begin_build()
+    {
+        this->begin_frame();
+    }
+
+    void end_build()
+    {
+        this->finish(&this->built);
+    }
+
+    // Prints the summary and the call sites; returns false if any frame allocated.
+    bool report()
+    {
+#ifndef TRACK_ALLOCATIONS
+        cerr << "Allocation tracking is not compiled in; rebuild with -DTRACK_ALLOCATIONS." << endl;
+        return false;
+#endif
+        cout << "Frames presented:        " << this->presented.frames << endl;
+        cout << "Frames that allocated:   " << this->presented.frames_allocating << endl;
+        cout << "Allocations / bytes:     " << this->presented.count << " / " << this->presented.bytes << endl;
+        cout << "Worst frame:             " << this->presented.max_frame_count << " / " << this->presented.max_frame_bytes << " bytes" << endl;
+        cout << "Frames built:            " << this->built.frames << endl;
+        cout << "Builds that allocated:   " << this->built.frames_allocating << endl;
+        cout << "Allocations / bytes:     " << this->built.count << " / " << this->built.bytes << endl;
+        cout << "Worst build:             " << this->built.max_frame_count << " / " << this->built.max_frame_bytes << " bytes" << endl;
+
+        Site sorted[site_capacity];
+        copy(begin(this->sites), end(this->sites), sorted);
+        sort(begin(sorted), end(sorted), [](const Site &a, const Site &b)
+             { return a.count > b.count; });
+        for (const Site &site : sorted)
+        {
+            if (!site.address)
+                break;
+            // Offsets are relative to the module, ready for addr2line -f -C -e.
+            Dl_info info;
+            uintptr_t offset = (uintptr_t)site.address;
+            const char *module = "?";
+            if (dladdr(site.address, &info))
+            {
+                offset -= (uintptr_t)info.dli_fbase;
+                module = info.dli_fname;
+            }
+            cout << "  " << module << "+0x" << hex << offset << dec << ": "
+                 << site.count << " allocations, " << site.bytes << " bytes" << endl;
+        }
+
+        return this->presented.frames_allocating == 0 && this->built.frames_allocating == 0;
+    }
+
+private:
+    // Several builders finish frames at once; the sites lock covers totals too.
+    void finish(Totals *totals)
+    {
+        is_tracking_allocations = false;
+        while (this->sites_lock.test_and_set(memory_order_acquire))
+            ;
+        totals->frames++;
+        if (tracked_count)
+        {
+            totals->frames_allocating++;
+            totals->count += tracked_count;
+            totals->bytes += tracked_bytes;
+            totals->max_frame_count = max(totals->max_frame_count, tracked_count);
+            totals->max_frame_bytes = max(totals->max_frame_bytes, tracked_bytes);
+        }
+        this->sites_lock.clear(memory_order_release);
+    }
+};
+
+AllocationTracker allocation_tracker;
+
+#ifdef TRACK_ALLOCATIONS
+void *tracked_allocation(size_t size, void *caller)
+{
+    void *pointer = malloc(size ? size : 1);
+    if (is_tracking_allocations)
+        allocation_tracker.record(caller, size);
+    return pointer;
+}
+
+void *operator new(size_t size)
+{
+    void *pointer = tracked_allocation(size, __builtin_return_address(0));
+    if (!pointer)
+        throw bad_alloc();
+    return pointer;
+}
+void *operator new[](size_t size)
+{
+    void *pointer = tracked_allocation(size, __builtin_return_address(0));
+    if (!pointer)
+        throw bad_alloc();
+    return pointer;
+}
+void *operator new(size_t size, const nothrow_t &) noexcept
+{
+    return tracked_allocation(size, __builtin_return_address(0));
+}
+void *operator new[](size_t size, const nothrow_t &) noexcept
+{
+    return tracked_allocation(size, __builtin_return_address(0));
+}
+// The replacement new above allocates with malloc, so free is the match.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+void operator delete(void *pointer) noexcept { free(pointer); }
+void operator delete[](void *pointer) noexcept { free(pointer); }
+void operator delete(void *pointer, size_t) noexcept { free(pointer); }
+void operator delete[](void *pointer, size_t) noexcept { free(pointer); }
+#pragma GCC diagnostic pop
+#endif
+
+typedef enum MarkerType
+{
+    MARKER_ONSET = 1,
+    MARKER_OFFSET,
+    MARKER_RESPONSE,
+} MarkerType;
+
+struct Marker
+{
+    uint64_t sequence;
+    int64_t time;     // session_time, in ns
+    int32_t type;     // MarkerType
+    int32_t code;     // key for responses, repetition for onset/offset
+    int32_t trial;    // presentation index in this session
+    int32_t frame;
+};
+
+// Shared memory layout: a header followed by `capacity` slots. Each slot is
+// a seqlock (odd while being written), so the writer never waits and slow
+// readers detect overwritten markers instead of blocking the render thread.
+struct MarkerSlot
+{
+    atomic<uint64_t> lock;
+    Marker marker;
+};
+
+struct MarkerRing
+{
+    uint64_t magic;
+    uint64_t capacity;
+    int64_t epoch; // steady_clock (CLOCK_MONOTONIC) ns of the session epoch
+    atomic<uint64_t> head;
+    MarkerSlot slots[];
+};
+
+const char *marker_shm_name = "/stimulus-markers";
+const char *marker_socket_path = "/tmp/stimulus-markers.sock";
+const uint64_t marker_magic = 0x4b52414d4d495453; // "STIMMARK"
+const uint64_t marker_capacity = 4096;
+
+// Event markers for co-located recorders. Publishing is wait-free into the
+// shared memory ring, or a non-blocking datagram when shared memory is
+// unavailable; either way it never stalls the frame.
+class MarkerChannel
+{
+public:
+    MarkerRing *ring = 0;
+    size_t ring_size = 0;
+    int socket_fd = -1;
+    sockaddr_un socket_address = {};
+
+    uint64_t sequence = 0;
+    int trial = -1;
+
+    bool is_open()
+    {
+        return this->ring || this->socket_fd >= 0;
+    }
+
+    bool open(bool use_shm = true)
+    {
+        this->close();
+
+        if (use_shm)
+        {
+            this->ring_size = sizeof(MarkerRing) + marker_capacity * sizeof(MarkerSlot);
+            int fd = shm_open(marker_shm_name, O_CREAT | O_RDWR, 0644);
+            if (fd >= 0 && ftruncate(fd, this->ring_size) == 0)
+            {
+                void *memory = mmap(0, this->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+                ::close(fd);
+                if (memory != MAP_FAILED)
+                {
+                    this->ring = (MarkerRing *)memory;
+                    this->ring->magic = 0;
+                    this->ring->capacity = marker_capacity;
+                    this->ring->epoch = chrono::duration_cast<chrono::nanoseconds>(session_clock.epoch.time_since_epoch()).count();
+                    this->ring->head.store(0, memory_order_relaxed);
+                    for (uint64_t i = 0; i < marker_capacity; i++)
+                        this->ring->slots[i].lock.store(0, memory_order_relaxed);
+                    atomic_thread_fence(memory_order_release);
+                    this->ring->magic = marker_magic;
+                    cout << "Publishing markers to shared memory " << marker_shm_name << endl;
+                    return true;
+                }
+            }
+            else if (fd >= 0)
+            {
+                ::close(fd);
+            }
+            cerr << "Shared memory markers unavailable; falling back to " << marker_socket_path << endl;
+        }
+
+        this->socket_fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+        if (this->socket_fd < 0)
+            return false;
+        this->socket_address.sun_family = AF_UNIX;
+        strncpy(this->socket_address.sun_path, marker_socket_path, sizeof(this->socket_address.sun_path) - 1);
+        cout << "Publishing markers to socket " << marker_socket_path << endl;
+        return true;
+    }
+
+    void close()
+    {
+        if (this->ring)
+        {
+            munmap(this->ring, this->ring_size);
+            shm_unlink(marker_shm_name);
+            this->ring = 0;
+        }
+        if (this->socket_fd >= 0)
+        {
+            ::close(this->socket_fd);
+            this->socket_fd = -1;
+        }
+    }
+
+    void publish(MarkerType type, int code, int frame, session_time time)
+    {
+        if (!this->is_open())
+            return;
+
+        Marker marker = {
+            .sequence = this->sequence,
+            .time = time.count(),
+            .type = type,
+            .code = code,
+            .trial = this->trial,
+            .frame = frame,
+        };
+
+        if (this->ring)
+        {
+            MarkerSlot &slot = this->ring->slots[this->sequence % marker_capacity];
+            slot.lock.store(2 * this->sequence + 1, memory_order_relaxed);
+            atomic_thread_fence(memory_order_release);
+            slot.marker = marker;
+            slot.lock.store(2 * this->sequence + 2, memory_order_release);
+            this->ring->head.store(this->sequence + 1, memory_order_release);
+        }
+        else
+        {
+            // Dropped when no recorder is bound or its queue is full.
+            sendto(this->socket_fd, &marker, sizeof(marker), MSG_DONTWAIT,
+                   (sockaddr *)&this->socket_address, sizeof(this->socket_address));
+        }
+        this->sequence++;
+    }
+};
+
+MarkerChannel markers;
+
+// Reads markers from the shared memory ring; returns false when marker
+// `index` was overwritten before it could be read.
+bool read_marker(MarkerRing *ring, uint64_t index, Marker *marker)
+{
+    MarkerSlot &slot = ring->slots[index % ring->capacity];
+    uint64_t lock = slot.lock.load(memory_order_acquire);
+    if (lock != 2 * index + 2)
+        return false;
+    *marker = slot.marker;
+    atomic_thread_fence(memory_order_acquire);
+    return slot.lock.load(memory_order_relaxed) == lock;
+}
+
+int64_t monotonic_ns()
+{
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Reference consumer (./s --markers-consume): prints every marker with the
+// publish-to-receive latency, from shared memory or, failing that, the socket.
+// With `limit` > 0 it stops after that many markers and returns the
+// shared memory latencies.
+vector<int64_t> consume_markers(uint64_t limit = 0, bool quiet = false)
+{
+    vector<int64_t> latencies = {};
+    latencies.reserve(limit);
+
+    int fd = shm_open(marker_shm_name, O_RDONLY, 0);
+    if (fd >= 0)
+    {
+        struct stat info;
+        fstat(fd, &info);
+        MarkerRing *ring = (MarkerRing *)mmap(0, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (ring == MAP_FAILED || ring->magic != marker_magic)
+        {
+            cerr << "Marker ring is not initialized." << endl;
+            return latencies;
+        }
+
+        uint64_t next = ring->head.load(memory_order_acquire);
+        uint64_t received = 0;
+        while (!limit || received < limit)
+        {
+            if (next == ring->head.load(memory_order_acquire))
+            {
+                this_thread::yield();
+                continue;
+            }
+
+            Marker marker;
+            if (!read_marker(ring, next, &marker))
+            {
+                uint64_t head = ring->head.load(memory_order_acquire);
+                cerr << "Lost markers " << next << ".." << head - 1 << endl;
+                next = head;
+                continue;
+            }
+            next++;
+            received++;
+
+            int64_t latency = monotonic_ns() - (ring->epoch + marker.time);
+            if (limit)
+                latencies.push_back(latency);
+            if (!quiet)
+                cout << marker.sequence << " type " << marker.type << " code " << marker.code << " trial " << marker.trial
+                     << " frame " << marker.frame << " at " << TimeBase::to_ms(session_time(marker.time)) << " ms"
+                     << " (+" << latency / 1000.0 << " us)" << endl;
+        }
+        munmap(ring, info.st_size);
+        return latencies;
+    }
+
+    int socket_fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, marker_socket_path, sizeof(address.sun_path) - 1);
+    unlink(marker_socket_path);
+    if (socket_fd < 0 || ::bind(socket_fd, (sockaddr *)&address, sizeof(address)) != 0)
+    {
+        cerr << "No marker channel to consume." << endl;
+        return latencies;
+    }
+
+    // Socket markers carry session times only, so latency is not reported.
+    Marker marker;
+    uint64_t received = 0;
+    while ((!limit || received < limit) && recv(socket_fd, &marker, sizeof(marker), 0) == sizeof(marker))
+    {
+        received++;
+        if (!quiet)
+            cout << marker.sequence << " type " << marker.type << " code " << marker.code << " trial " << marker.trial
+                 << " frame " << marker.frame << " at " << TimeBase::to_ms(session_time(marker.time)) << " ms" << endl;
+    }
+    ::close(socket_fd);
+    unlink(marker_socket_path);
+    return latencies;
+}
+
+// Latency benchmark (./s --markers-bench): a forked consumer spins on the
+// ring while this process publishes, then reports the latency distribution.
+bool benchmark_markers(int count = 20000)
+{
+    if (!markers.open(true) || !markers.ring)
+        return false;
+
+    int pipe_fd[2];
+    if (pipe(pipe_fd) != 0)
+        return false;
+
+    pid_t child = fork();
+    if (child == 0)
+    {
+        ::close(pipe_fd[0]);
+        char ready = 1;
+        if (write(pipe_fd[1], &ready, 1) != 1)
+            _exit(EXIT_FAILURE);
+
+        vector<int64_t> latencies = consume_markers(count, true);
+        sort(latencies.begin(), latencies.end());
+        if (latencies.empty())
+            _exit(EXIT_FAILURE);
+
+        auto percentile = [&](double p)
+        {
+            return latencies[min(latencies.size() - 1, (size_t)(p * latencies.size()))] / 1000.0;
+        };
+        cout << "Markers received: " << latencies.size() << endl;
+        cout << "Latency p50: " << percentile(0.5) << " us" << endl;
+        cout << "Latency p99: " << percentile(0.99) << " us" << endl;
+        cout << "Latency max: " << latencies.back() / 1000.0 << " us" << endl;
+        _exit(percentile(0.99) < 100 ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    ::close(pipe_fd[1]);
+    char ready;
+    if (read(pipe_fd[0], &ready, 1) != 1)
+        return false;
+    ::close(pipe_fd[0]);
+    // Give the consumer time to map the ring and start polling.
+    this_thread::sleep_for(chrono::milliseconds(50));
+
+    for (int i = 0; i < count; i++)
+    {
+        markers.publish(MARKER_RESPONSE, i, i, session_clock.now());
+        // Sleep between markers like the render thread does between swaps.
+        this_thread::sleep_for(chrono::microseconds(100));
+    }
+
+    int status = 0;
+    waitpid(child, &status, 0);
+    markers.close();
+    return WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS;
+}
+
+const char *control_socket_path = "/tmp/stimulus-control.sock";
+
+struct ControlCommand
+{
+    int client; // connection id, never reused; not the socket fd
+    string name;
+    vector<int> args;
+};
+
+// Local remote-control socket (./s --control). A listener thread accepts
+// line-based commands and queues them; the render thread drains the queue
+// at frame boundaries without blocking. STATUS and ABORT are answered from
+// the listener thread directly, so they also work during a presentation.
+// A client that shuts down its sending side is kept until every command it
+// sent is answered, so `printf ... | socat` still receives DONE.
+//
+//   LOAD                     reload the library from disk
+//   ADD <index>              append library[index] to the experiment
+//   REMOVE <index>           remove experiment[index]
+//   CLEAR                    empty the experiment
+//   SEQUENCE <participant> [repeats] [blocks] [max_run] [max_congruency_run]
+//   START                    present; replies DONE when finished
+//   ABORT                    stop the current presentation
+//   STATUS                   screen, library, experiment, trials, trial
+//   QUIT                     close the program
+class ControlServer
+{
+public:
+    atomic<bool> is_running = false;
+    thread listener;
+    int listen_fd = -1;
+
+    mutex queue_mutex;
+    deque<ControlCommand> commands = {};
+    deque<tuple<int, string, bool>> replies = {};
+
+    // Snapshot published by the render thread for STATUS.
+    atomic<int> status_screen = 0;
+    atomic<int> status_library = 0;
+    atomic<int> status_experiment = 0;
+    atomic<int> status_trials = 0;
+    atomic<int> status_trial = -1;
+
+    bool start()
+    {
+        this->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        sockaddr_un address = {};
+        address.sun_family = AF_UNIX;
+        strncpy(address.sun_path, control_socket_path, sizeof(address.sun_path) - 1);
+        unlink(control_socket_path);
+        if (this->listen_fd < 0 || ::bind(this->listen_fd, (sockaddr *)&address, sizeof(address)) != 0 || listen(this->listen_fd, 4) != 0)
+        {
+            cerr << "Failed to open control socket " << control_socket_path << endl;
+            return false;
+        }
+
+        this->is_running = true;
+        this->listener = thread(&ControlServer::listen_loop, this);
+        cout << "Listening for control commands on " << control_socket_path << endl;
+        return true;
+    }
+
+    void stop()
+    {
+        if (!this->is_running)
+            return;
+        this->is_running = false;
+        this->listener.join();
+        ::close(this->listen_fd);
+        unlink(control_socket_path);
+    }
+
+    ~ControlServer()
+    {
+        this->stop();
+    }
+
+    // Render thread: pops the next queued command, or returns false if there
+    // is none or the listener holds the lock right now.
+    bool next(ControlCommand *command)
+    {
+        unique_lock<mutex> lock(this->queue_mutex, try_to_lock);
+        if (!lock.owns_lock() || this->commands.empty())
+            return false;
+        *command = this->commands.front();
+        this->commands.pop_front();
+        return true;
+    }
+
+    // Every queued command gets exactly one last reply; START's "OK started"
+    // is not its last, DONE is.
+    void reply(int client, string text, bool is_last = true)
+    {
+        lock_guard<mutex> lock(this->queue_mutex);
+        this->replies.push_back(make_tuple(client, text + "\n", is_last));
+    }
+
+private:
+    void listen_loop()
+    {
+        // Replies are routed by connection id: a closed client's fd can be
+        // reused by a new connection before a late reply (such as DONE) is sent.
+        vector<pollfd> fds = {{this->listen_fd, POLLIN, 0}};
+        vector<int> ids = {0};
+        unordered_map<int, int> client_fds = {};
+        unordered_map<int, string> buffers = {};
+        unordered_map<int, int> pending = {}; // queued commands not yet answered
+        int next_id = 1;
+
+        while (this->is_running)
+        {
+            poll(fds.data(), fds.size(), 10);
+
+            if (fds[0].revents & POLLIN)
+            {
+                int client = accept(this->listen_fd, 0, 0);
+                if (client >= 0)
+                {
+                    fds.push_back({client, POLLIN, 0});
+                    ids.push_back(next_id);
+                    client_fds[next_id] = client;
+                    next_id++;
+                }
+            }
+
+            for (size_t i = 1; i < fds.size(); i++)
+            {
+                if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR)))
+                    continue;
+
+                // A half-closed client (events == 0) only reports a hangup.
+                char data[512];
+                ssize_t size = fds[i].events ? recv(fds[i].fd, data, sizeof(data), 0) : -1;
+                if (size == 0 && pending[ids[i]] > 0)
+                {
+                    fds[i].events = 0;
+                    continue;
+                }
+                if (size <= 0)
+                {
+                    ::close(fds[i].fd);
+                    buffers.erase(ids[i]);
+                    client_fds.erase(ids[i]);
+                    pending.erase(ids[i]);
+                    fds.erase(fds.begin() + i);
+                    ids.erase(ids.begin() + i);
+                    i--;
+                    continue;
+                }
+
+                string &buffer = buffers[ids[i]];
+                buffer.append(data, size);
+                size_t end;
+                while ((end = buffer.find('\n')) != string::npos)
+                {
+                    if (this->parse(ids[i], fds[i].fd, buffer.substr(0, end)))
+                        pending[ids[i]]++;
+                    buffer.erase(0, end + 1);
+                }
+            }
+
+            deque<tuple<int, string, bool>> replies;
+            {
+                lock_guard<mutex> lock(this->queue_mutex);
+                replies.swap(this->replies);
+            }
+            for (auto &[id, text, is_last] : replies)
+            {
+                auto client = client_fds.find(id);
+                if (client == client_fds.end())
+                    continue;
+                send(client->second, text.data(), text.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+                if (is_last)
+                    pending[id]--;
+            }
+
+            // Half-closed clients go once their last reply is out.
+            for (size_t i = 1; i < fds.size(); i++)
+            {
+                if (fds[i].events || pending[ids[i]] > 0)
+                    continue;
+                ::close(fds[i].fd);
+                buffers.erase(ids[i]);
+                client_fds.erase(ids[i]);
+                pending.erase(ids[i]);
+                fds.erase(fds.begin() + i);
+                ids.erase(ids.begin() + i);
+                i--;
+            }
+        }
+
+        for (size_t i = 1; i < fds.size(); i++)
+            ::close(fds[i].fd);
+    }
+
+    // Returns whether the command was queued for the render thread.
+    bool parse(int id, int client, string line)
+    {
+        stringstream stream(line);
+        ControlCommand command;
+        command.client = id;
+        stream >> command.name;
+        transform(command.name.begin(), command.name.end(), command.name.begin(), ::toupper);
+        int arg;
+        while (stream >> arg)
+            command.args.push_back(arg);
+
+        if (command.name.empty())
+            return false;
+
+        if (command.name == "STATUS")
+        {
+            const char *screens[] = {"LOGO", "MAIN", "EDITTING", "PRESENTING", "REPORT", "ENDING"};
+            int screen = this->status_screen;
+            string text = string("OK screen=") + screens[screen] +
+                          " library=" + std::to_string(this->status_library) +
+                          " experiment=" + std::to_string(this->status_experiment) +
+                          " trials=" + std::to_string(this->status_trials) +
+                          " trial=" + std::to_string(this->status_trial);
+            text += "\n";
+            send(client, text.data(), text.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+        }
+        else if (command.name == "ABORT")
+        {
+            should_break = true;
+            send(client, "OK\n", 3, MSG_DONTWAIT | MSG_NOSIGNAL);
+        }
+        else
+        {
+            lock_guard<mutex> lock(this->queue_mutex);
+            this->commands.push_back(command);
+            return true;
+        }
+        return false;
+    }
+};
+
+ControlServer control;
+
+// Background writer for the stimulus library. The render thread hands over
+// already serialized files; the writer skips content that is already on
+// disk (file names are content hashes), writes the rest to temporary files
+// and renames them into place, so a crash never leaves a truncated file.
+// Everything queued by the time the writer wakes up is synced together:
+// one syncfs() before the renames, one directory fsync after them.
+class LibraryWriter
+{
+public:
+    struct File
+    {
+        string directory;
+        string name;
+        string body;
+        bool is_content_named = true; // an existing file with this name may already hold the body
+    };
+
+    thread worker;
+    mutex queue_mutex;
+    condition_variable queue_changed;
+    vector<File> queue = {};
+    bool is_running = false;
+
+    void save_all(vector<File> files)
+    {
+        lock_guard<mutex> lock(this->queue_mutex);
+        if (!this->is_running)
+        {
+            this->is_running = true;
+            this->worker = thread(&LibraryWriter::write_loop, this);
+        }
+        for (File &file : files)
+            this->queue.push_back(std::move(file));
+        this->queue_changed.notify_one();
+    }
+
+    // Writes whatever is still queued and joins the worker.
+    void stop()
+    {
+        {
+            lock_guard<mutex> lock(this->queue_mutex);
+            if (!this->is_running)
+                return;
+            this->is_running = false;
+            this->queue_changed.notify_one();
+        }
+        this->worker.join();
+    }
+
+private:
+    void write_loop()
+    {
+        while (true)
+        {
+            vector<File> batch = {};
+            {
+                unique_lock<mutex> lock(this->queue_mutex);
+                this->queue_changed.wait(lock, [this]()
+                                         { return !this->queue.empty() || !this->is_running; });
+                if (this->queue.empty())
+                    return;
+                batch.swap(this->queue);
+            }
+            this->write(batch);
+        }
+    }
+
+    void write(vector<File> &batch)
+    {
+        vector<pair<string, string>> renames = {};
+        for (File &file : batch)
+        {
+            string path = file.directory + file.name;
+            if (file.is_content_named && this->holds(path, file.body))
+                continue;
+
+            string temporary = path + ".tmp";
+            int fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd < 0)
+            {
+                cerr << "Failed to write " << temporary << endl;
+                continue;
+            }
+            size_t written = 0;
+            while (written < file.body.size())
+            {
+                ssize_t size = ::write(fd, file.body.data() + written, file.body.size() - written);
+                if (size <= 0)
+                    break;
+                written += size;
+            }
+            ::close(fd);
+
+            if (written == file.body.size())
+                renames.push_back(make_pair(temporary, path));
+            else
+                unlink(temporary.c_str());
+        }
+
+        if (renames.empty())
+            return;
+
+        // One sync flushes every temporary file of the batch before any of
+        // them replaces its target; the directory sync persists the renames.
+        // An editor batch has one directory; a session log queued alongside
+        // it adds a second directory sync, never a second syncfs.
+        vector<string> directories = {};
+        for (auto &r : renames)
+        {
+            string directory = filesystem::path(r.second).parent_path().string();
+            if (find(directories.begin(), directories.end(), directory) == directories.end())
+                directories.push_back(directory);
+        }
+        int sync_fd = ::open(directories[0].c_str(), O_RDONLY | O_DIRECTORY);
+        if (sync_fd >= 0)
+        {
+            syncfs(sync_fd);
+            ::close(sync_fd);
+        }
+        for (auto &r : renames)
+            rename(r.first.c_str(), r.second.c_str());
+        for (const string &directory : directories)
+        {
+            int dir_fd = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+            if (dir_fd >= 0)
+            {
+                fsync(dir_fd);
+                ::close(dir_fd);
+            }
+        }
+
+        cout << "Saved " << renames.size() << " of " << batch.size() << " files" << endl;
+    }
+
+    // Names are only hashes, so a file of the same size is compared byte
+    // for byte before the write is skipped.
+    bool holds(const string &path, const string &body)
+    {
+        error_code error;
+        if (filesystem::file_size(path, error) != body.size())
+            return false;
+        ifstream existing(path, ios::binary);
+        string contents((istreambuf_iterator<char>(existing)), istreambuf_iterator<char>());
+        return contents == body;
+    }
+};
+
+LibraryWriter library_writer;
+
+// 64-bit FNV-1a over whole words; frame hashes only need to be stable and
+// cheap enough to run before every swap.
+uint64_t hash_words(uint64_t hash, const void *data, size_t size)
+{
+    const unsigned char *bytes = (const unsigned char *)data;
+    size_t words = size / 8;
+    for (size_t i = 0; i < words; i++)
+    {
+        uint64_t word;
+        memcpy(&word, bytes + i * 8, 8);
+        hash = (hash ^ word) * 1099511628211ull;
+    }
+    for (size_t i = words * 8; i < size; i++)
+        hash = (hash ^ bytes[i]) * 1099511628211ull;
+    return hash;
+}
+
+const uint64_t hash_seed = 14695981039346656037ull;
+
+// Everything presented during a session: the definition each stimulus had
+// when it was presented (after any staircase adjustment), how many frames
+// every repetition showed and the hash of every frame. --replay re-renders
+// a session from this and checks the hashes.
+// Version 2: picks draw from per-frame engines instead of the global rand().
+const int session_log_version = 2;
+
+class SessionLog
+{
+public:
+    bool is_recording = false;
+    Json::Value root;
+    string name = "";
+
+    void begin()
+    {
+        this->root = Json::Value(Json::objectValue);
+        this->root["version"] = session_log_version;
+        this->root["screen_width"] = screen_width;
+        this->root["screen_height"] = screen_height;
+        this->root["presentations"] = Json::Value(Json::arrayValue);
+        // Nanoseconds, so sessions started within the same second never share a name.
+        this->name = "session_" + std::to_string(chrono::duration_cast<chrono::nanoseconds>(chrono::system_clock::now().time_since_epoch()).count()) + ".json";
+        this->is_recording = true;
+    }
+
+    void record(const Json::String &stimulus, const vector<int> &frame_counts, const vector<uint64_t> &hashes)
+    {
+        Json::Value presentation;
+        Json::Reader reader;
+        reader.parse(stimulus, presentation["stimulus"]);
+        for (int count : frame_counts)
+            presentation["frames"].append(count);
+
+        string hex(hashes.size() * 16, '0');
+        for (size_t f = 0; f < hashes.size(); f++)
+            snprintf(&hex[f * 16], 17, "%016llx", (unsigned long long)hashes[f]);
+        presentation["hashes"] = hex;
+
+        this->root["presentations"].append(presentation);
+    }
+
+    void end()
+    {
+        if (!this->is_recording)
+            return;
+        this->is_recording = false;
+        library_writer.save_all({{"./files/sessions/", this->name, this->root.toStyledString(), false}});
+        cout << "Session log: ./files/sessions/" << this->name << endl;
+    }
+};
+
+SessionLog session_log;
+
+const char *sdf_font_path = "./files/fonts/default.ttf";
+const char *sdf_cache_dir = "./files/fonts/cache/";
+
+const char *sdf_fragment_shader = R"(
+#version 330
+in vec2 fragTexCoord;
+in vec4 fragColor;
+uniform sampler2D texture0;
+uniform vec4 colDiffuse;
+out vec4 finalColor;
+void main()
+{
+    float distance_from_outline = texture(texture0, fragTexCoord).a - 0.5;
+    float distance_per_fragment = length(vec2(dFdx(distance_from_outline), dFdy(distance_from_outline)));
+    float alpha = smoothstep(-distance_per_fragment, distance_per_fragment, distance_from_outline);
+    finalColor = vec4(fragColor.rgb, fragColor.a * alpha);
+}
+)";
+
+// Signed distance field glyph atlas. It is generated once per font file and
+// cached on disk (atlas png + glyph metrics json), so every font size is
+// rendered from the same texture through the SDF shader.
+class SdfFont
+{
+public:
+    Font font = {};
+    Shader shader = {};
+    bool is_sdf = false;
+    int shader_depth = 0;
+
+    int base_size = 64;
+    int glyph_count = 95; // ASCII 32..126
+    int padding = 4;
+
+    void load(const char *path)
+    {
+        this->unload();
+
+        unsigned int data_size = 0;
+        unsigned char *data = filesystem::exists(path) ? LoadFileData(path, &data_size) : 0;
+        if (!data)
+        {
+            cerr << "SDF font not found at " << path << "; using the default bitmap font." << endl;
+            this->font = GetFontDefault();
+            return;
+        }
+
+        stringstream stream;
+        stream << hex << hash<string_view>{}(string_view((const char *)data, data_size))
+               << dec << "_" << this->base_size << "_" << this->glyph_count;
+        string cache = sdf_cache_dir + stream.str();
+
+        if (!this->load_cache(cache))
+        {
+            this->generate(data, data_size, cache);
+        }
+        UnloadFileData(data);
+
+        SetTextureFilter(this->font.texture, TEXTURE_FILTER_BILINEAR);
+        this->shader = LoadShaderFromMemory(0, sdf_fragment_shader);
+        this->is_sdf = true;
+    }
+
+    void unload()
+    {
+        if (this->is_sdf)
+        {
+            UnloadFont(this->font);
+            UnloadShader(this->shader);
+        }
+        this->font = {};
+        this->shader = {};
+        this->is_sdf = false;
+    }
+
+    float spacing(float font_size)
+    {
+        // Matches DrawText() for the default font; SDF glyphs carry their own advance.
+        return this->is_sdf ? 0 : font_size / 10;
+    }
+
+    Vector2 measure(const char *text, float font_size)
+    {
+        return MeasureTextEx(this->font, text, font_size, this->spacing(font_size));
+    }
+
+    // Text drawn between begin() and end() shares one shader pass, so a
+    // block of labels costs one batch flush instead of two per label.
+    void begin()
+    {
+        if (this->is_sdf && this->shader_depth++ == 0)
+            BeginShaderMode(this->shader);
+    }
+
+    void end()
+    {
+        if (this->is_sdf && --this->shader_depth == 0)
+            EndShaderMode();
+    }
+
+    void draw(const char *text, Vector2 position, float font_size, Color color)
+    {
+        this->begin();
+        DrawTextEx(this->font, text, position, font_size, this->spacing(font_size), color);
+        this->end();
+    }
+
+private:
+    void generate(unsigned char *data, unsigned int data_size, string cache)
+    {
+        session_time t_start = session_clock.now();
+
+        this->font.baseSize = this->base_size;
+        this->font.glyphCount = this->glyph_count;
+        this->font.glyphPadding = this->padding;
+        this->font.glyphs = LoadFontData(data, data_size, this->base_size, 0, this->glyph_count, FONT_SDF);
+
+        Image atlas = GenImageFontAtlas(this->font.glyphs, &this->font.recs, this->glyph_count, this->base_size, this->padding, 1);
+        this->font.texture = LoadTextureFromImage(atlas);
+
+        Json::Value root;
+        root["base_size"] = this->base_size;
+        root["padding"] = this->padding;
+        for (int g = 0; g < this->glyph_count; g++)
+        {
+            Json::Value glyph;
+            glyph["value"] = this->font.glyphs[g].value;
+            glyph["offset_x"] = this->font.glyphs[g].offsetX;
+            glyph["offset_y"] = this->font.glyphs[g].offsetY;
+            glyph["advance_x"] = this->font.glyphs[g].advanceX;
+            glyph["x"] = this->font.recs[g].x;
+            glyph["y"] = this->font.recs[g].y;
+            glyph["width"] = this->font.recs[g].width;
+            glyph["height"] = this->font.recs[g].height;
+            root["glyphs"].append(glyph);
+        }
+
+        // Written under temporary names and renamed into place, the JSON
+        // last, so an interrupted run never leaves a cache that looks complete.
+        filesystem::create_directories(sdf_cache_dir);
+        error_code error;
+        if (ExportImage(atlas, (cache + ".tmp.png").c_str()))
+            filesystem::rename(cache + ".tmp.png", cache + ".png", error);
+        ofstream file = ofstream(cache + ".json.tmp", ios::out);
+        file << root.toStyledString();
+        file.close();
+        if (!error && file)
+            filesystem::rename(cache + ".json.tmp", cache + ".json", error);
+        UnloadImage(atlas);
+
+        cout << "SDF atlas generated in " << TimeBase::to_ms(session_clock.now() - t_start) << " ms" << endl;
+    }
+
+    bool load_cache(string cache)
+    {
+        if (!filesystem::exists(cache + ".png") || !filesystem::exists(cache + ".json"))
+            return false;
+
+        // A cache that does not parse is treated as missing and regenerated.
+        ifstream input_file(cache + ".json");
+        Json::Value root;
+        Json::Reader reader;
+        bool parsed = reader.parse(input_file, root);
+        input_file.close();
+        if (!parsed || !root.isObject())
+            return false;
+
+        Json::Value glyphs = root["glyphs"];
+        if (!glyphs.isArray() || glyphs.size() != (unsigned int)this->glyph_count)
+            return false;
+
+        Image atlas = LoadImage((cache + ".png").c_str());
+        if (!atlas.data)
+            return false;
+
+        this->font.baseSize = root["base_size"].asInt();
+        this->font.glyphCount = this->glyph_count;
+        this->font.glyphPadding = root["padding"].asInt();
+        this->font.glyphs = (GlyphInfo *)MemAlloc(this->glyph_count * sizeof(GlyphInfo));
+        this->font.recs = (Rectangle *)MemAlloc(this->glyph_count * sizeof(Rectangle));
+        for (int g = 0; g < this->glyph_count; g++)
+        {
+            // Glyph images are only needed to build the atlas; MemAlloc zeroes them.
+            this->font.glyphs[g].value = glyphs[g]["value"].asInt();
+            this->font.glyphs[g].offsetX = glyphs[g]["offset_x"].asInt();
+            this->font.glyphs[g].offsetY = glyphs[g]["offset_y"].asInt();
+            this->font.glyphs[g].advanceX = glyphs[g]["advance_x"].asInt();
+            this->font.recs[g] = (Rectangle){
+                .x = glyphs[g]["x"].asFloat(),
+                .y = glyphs[g]["y"].asFloat(),
+                .width = glyphs[g]["width"].asFloat(),
+                .height = glyphs[g]["height"].asFloat(),
+            };
+        }
+        this->font.texture = LoadTextureFromImage(atlas);
+        UnloadImage(atlas);
+
+        return true;
+    }
+};
+
+SdfFont text_font;
+
+typedef enum Screen
+{
+    LOGO = 0,
+    MAIN,
+    EDITTING,
+    PRESENTING,
+    REPORT,
+    ENDING
+} Screen;
+
+typedef enum Stim
+{
+    FIXING,
+    RANDOM_CIRCLES,
+    COLORED_WORDS,
+    GRATING,
+    NOISE_MASK,
+} Stim;
+
+// What an editor field change invalidates in the preview.
+typedef enum Dirty
+{
+    DIRTY_NONE = 0,
+    DIRTY_RENDER = 1,
+    DIRTY_LAYOUT = 3, // re-pick, then re-render
+    DIRTY_FPS = 4,
+    DIRTY_ALL = 7,
+} Dirty;
+
+// The monitor's real refresh period, measured from vsync'd swaps at startup.
+// Stimulus frame rates are mapped onto whole refresh intervals: each frame is
+// held for the same number of refreshes and durations are rounded to whole
+// frames, so cadence is even and presentation times are exact multiples of
+// the refresh period.
+class Display
+{
+public:
+    bool is_measured = false;
+    bool is_vsynced = false; // swaps were observed to lock to vblank
+    double refresh_hz = 0;
+    double period_ms = 0;
+    double jitter_ms = 0;
+
+    void measure(int swaps = 300)
+    {
+        SetTargetFPS(0);
+        vector<session_time> flips = {};
+        flips.reserve(swaps + 1);
+        for (int i = 0; i <= swaps; i++)
+        {
+            BeginDrawing();
+            ClearBackground(RAYWHITE);
+            text_font.draw("Measuring refresh rate", (Vector2){5, screen_height - 50}, 50, LIGHTGRAY);
+            EndDrawing();
+            flips.push_back(session_clock.now());
+        }
+
+        vector<double> intervals = {};
+        for (size_t i = 1; i < flips.size(); i++)
+            intervals.push_back(TimeBase::to_ms(flips[i] - flips[i - 1]));
+        vector<double> sorted = intervals;
+        sort(sorted.begin(), sorted.end());
+        double median = sorted[sorted.size() / 2];
+
+        // Without vsync the swaps return immediately and say nothing about the panel.
+        if (median < 1.0)
+        {
+            int hz = GetMonitorRefreshRate(GetCurrentMonitor());
+            if (hz > 0)
+                cerr << "Swaps are not synced to vblank; using the reported " << hz << " Hz refresh rate" << endl;
+            else
+                cerr << "Swaps are not synced to vblank and no refresh rate is reported; frames are paced by timer" << endl;
+            this->is_measured = hz > 0;
+            this->refresh_hz = hz;
+            this->period_ms = hz > 0 ? 1000.0 / hz : 0;
+            return;
+        }
+
+        // Missed or doubled vblanks are dropped before averaging.
+        double sum = 0, sum_squares = 0;
+        int count = 0;
+        for (double interval : intervals)
+        {
+            if (fabs(interval - median) > 0.1 * median)
+                continue;
+            sum += interval;
+            sum_squares += interval * interval;
+            count++;
+        }
+        this->period_ms = sum / count;
+        this->jitter_ms = sqrt(max(0.0, sum_squares / count - this->period_ms * this->period_ms));
+        this->refresh_hz = 1000.0 / this->period_ms;
+        this->is_measured = true;
+        this->is_vsynced = true;
+
+        cout << "Display: " << fixed << setprecision(3) << this->refresh_hz << " Hz, period " << this->period_ms
+             << " ms, jitter " << this->jitter_ms << " ms over " << count << " of " << swaps << " swaps" << endl;
+        cout.unsetf(ios::fixed);
+        cout << setprecision(6);
+    }
+
+    // Refreshes each frame is shown for; warns when FPS does not divide the refresh rate.
+    int refreshes_per_frame(int FPS)
+    {
+        if (!this->is_measured || FPS <= 0)
+            return 1;
+        double ratio = this->refresh_hz / FPS;
+        int hold = max(1, (int)lround(ratio));
+        if (fabs(ratio - hold) > 0.02 * hold)
+            cerr << "Warning: " << FPS << " FPS is not a divisor of the " << lround(this->refresh_hz)
+                 << " Hz refresh rate; presenting at " << this->refresh_hz / hold << " FPS" << endl;
+        return hold;
+    }
+
+    // Frames covering seconds when each is held for hold refreshes.
+    int frames_for(double seconds, int hold)
+    {
+        return (int)lround(seconds * this->refresh_hz / hold);
+    }
+};
+
+Display display;
+
+// A draw call recorded off the render thread. Only the render thread owns
+// the GL context, so builders describe a frame and submit() replays it.
+typedef enum DrawType
+{
+    DRAW_CIRCLE = 0,
+    DRAW_TEXT,
+    DRAW_TEXTURE,
+} DrawType;
+
+struct DrawCommand
+{
+    DrawType type;
+    float x;
+    float y;
+    float size;
+    Color color;
+    const char *text;
+    Texture2D texture;
+};
+
+void submit(const vector<DrawCommand> &commands)
+{
+    // Consecutive text commands share one shader pass.
+    bool is_text = false;
+    for (const DrawCommand &command : commands)
+    {
+        if (is_text != (command.type == DRAW_TEXT))
+        {
+            is_text = !is_text;
+            if (is_text)
+                text_font.begin();
+            else
+                text_font.end();
+        }
+        switch (command.type)
+        {
+        case DRAW_CIRCLE:
+            DrawCircle((int)command.x, (int)command.y, command.size, command.color);
+            break;
+        case DRAW_TEXT:
+            text_font.draw(command.text, (Vector2){command.x, command.y}, command.size, command.color);
+            break;
+        case DRAW_TEXTURE:
+            DrawTexture(command.texture, (int)command.x, (int)command.y, command.color);
+            break;
+        }
+    }
+    if (is_text)
+        text_font.end();
+}
+
+// Builds frames ahead of the render thread. A pool of builder threads fills
+// up to depth frames (picking and recording their draw commands) while the
+// render thread submits the oldest one and waits on vsync, so a slow pick()
+// only costs the swap deadline once the queue has run dry. Frames are
+// numbered; each builder claims the next number and writes its slot, and the
+// render thread takes them back in order. build(worker, number, frame) must
+// depend on nothing but the number, so frames come out the same whichever
+// builder makes them and in whatever order.
+class FramePipeline
+{
+public:
+    struct Frame
+    {
+        vector<DrawCommand> commands;
+        uint64_t hash;
+        int repetition;
+        int index; // 1-based within its repetition
+    };
+
+    static const int depth = 8;
+    Frame frames[depth];
+    bool is_ready[depth] = {};
+
+    // Leaves a core for the render thread.
+    const int worker_count = max(1, min((int)thread::hardware_concurrency() - 1, depth - 1));
+
+    vector<thread> workers = {};
+    mutex frame_mutex;
+    condition_variable frame_changed;
+    bool is_running = false;
+    bool has_job = false;
+    bool is_cancelled = false;
+    int building = 0;            // builders outside the lock
+    size_t claimed = 0;          // next number to hand out
+    size_t presented = 0;        // next number to show
+    size_t limit = SIZE_MAX;     // first number build() rejected
+    function<bool(int, size_t, Frame *)> build = nullptr;
+
+    // Starts building with build(worker, number, frame) for number 0, 1, ...
+    // until it returns false. Every slot is sized for commands commands up
+    // front so building never grows it.
+    void begin(function<bool(int, size_t, Frame *)> build, size_t commands)
+    {
+        unique_lock<mutex> lock(this->frame_mutex);
+        for (Frame &frame : this->frames)
+            frame.commands.reserve(commands);
+        if (!this->is_running)
+        {
+            this->is_running = true;
+            for (int w = 0; w < this->worker_count; w++)
+                this->workers.push_back(thread(&FramePipeline::build_loop, this, w));
+        }
+        this->build = std::move(build);
+        fill(this->is_ready, this->is_ready + depth, false);
+        this->claimed = 0;
+        this->presented = 0;
+        this->limit = SIZE_MAX;
+        this->is_cancelled = false;
+        this->has_job = true;
+        this->frame_changed.notify_all();
+    }
+
+    // The next frame in order, or 0 once there is none left.
+    Frame *acquire()
+    {
+        unique_lock<mutex> lock(this->frame_mutex);
+        Frame *frame = &this->frames[this->presented % depth];
+        bool *is_ready = &this->is_ready[this->presented % depth];
+        this->frame_changed.wait(lock, [this, is_ready]()
+                                 { return *is_ready || this->presented >= this->limit; });
+        return *is_ready ? frame : 0;
+    }
+
+    void release()
+    {
+        lock_guard<mutex> lock(this->frame_mutex);
+        this->is_ready[this->presented % depth] = false;
+        this->presented++;
+        this->frame_changed.notify_all();
+    }
+
+    // Stops building and waits until no builder touches the stimulus.
+    void end()
+    {
+        unique_lock<mutex> lock(this->frame_mutex);
+        this->is_cancelled = true;
+        this->frame_changed.notify_all();
+        this->frame_changed.wait(lock, [this]()
+                                 { return this->building == 0; });
+        this->has_job = false;
+        this->build = nullptr;
+    }
+
+    void stop()
+    {
+        {
+            lock_guard<mutex> lock(this->frame_mutex);
+            if (!this->is_running)
+                return;
+            this->is_running = false;
+            this->frame_changed.notify_all();
+        }
+        for (thread &worker : this->workers)
+            worker.join();
+        this->workers.clear();
+    }
+
+private:
+    void build_loop(int worker)
+    {
+        unique_lock<mutex> lock(this->frame_mutex);
+        while (true)
+        {
+            this->frame_changed.wait(lock, [this]()
+                                     { return !this->is_running ||
+                                              (this->has_job && !this->is_cancelled && this->claimed < this->limit &&
+                                               this->claimed - this->presented < depth); });
+            if (!this->is_running)
+                return;
+
+            // The slot is free: the render thread released number - depth.
+            size_t number = this->claimed++;
+            Frame *frame = &this->frames[number % depth];
+            this->building++;
+            lock.unlock();
+            bool has_frame = this->build(worker, number, frame);
+            lock.lock();
+            this->building--;
+            if (has_frame)
+                this->is_ready[number % depth] = true;
+            else
+                this->limit = min(this->limit, number);
+            this->frame_changed.notify_all();
+        }
+    }
+};
+
+FramePipeline frame_pipeline;
+
+// Bayesian adaptive staircase (QUEST). The posterior over the threshold is
+// kept on a dense grid of log10 intensities. Tested intensities are snapped
+// to that grid, so the likelihood of a response is a precomputed Weibull
+// table indexed by grid offset and an update is one multiply-and-sum pass.
+class Staircase
+{
+public:
+    int *intensity = 0; // stimulus parameter driven by this staircase
+    int min_intensity = 1;
+    int max_intensity = 1000;
+    int yes_key = KEY_Y; // a trial counts as "seen" when this key was pressed
+
+    double beta = 3.5;   // Weibull slope
+    double gamma = 0.0;  // guess rate; 0.5 for two-alternative tasks
+    double delta = 0.01; // lapse rate
+
+    int grid_size = 1001;
+    double grid_min = 0;
+    double grid_step = 0;
+    vector<double> posterior = {};
+    vector<double> likelihood_yes = {}; // indexed by tested - threshold + grid_size - 1
+    vector<double> likelihood_no = {};
+
+    int trials = 0;
+    int tested = 0; // grid index of the intensity last applied
+
+    Staircase(int *intensity, int min_intensity, int max_intensity)
+    {
+        this->intensity = intensity;
+        this->min_intensity = max(1, min_intensity);
+        this->max_intensity = max(this->min_intensity + 1, max_intensity);
+        this->reset();
+    }
+
+    void reset()
+    {
+        int n = this->grid_size;
+        this->grid_min = log10((double)this->min_intensity);
+        this->grid_step = (log10((double)this->max_intensity) - this->grid_min) / (n - 1);
+
+        // Gaussian prior centred on the range, half the range wide.
+        this->posterior.assign(n, 0);
+        double sd = (n - 1) * 0.5;
+        for (int i = 0; i < n; i++)
+        {
+            double z = (i - (n - 1) * 0.5) / sd;
+            this->posterior[i] = exp(-0.5 * z * z);
+        }
+        this->normalize();
+
+        this->likelihood_yes.assign(2 * n - 1, 0);
+        this->likelihood_no.assign(2 * n - 1, 0);
+        for (int k = 0; k < 2 * n - 1; k++)
+        {
+            double offset = (k - (n - 1)) * this->grid_step;
+            double p = this->gamma + (1 - this->gamma - this->delta) * (1 - exp(-pow(10, this->beta * offset)));
+            this->likelihood_yes[k] = p;
+            this->likelihood_no[k] = 1 - p;
+        }
+
+        this->trials = 0;
+        this->tested = n / 2;
+    }
+
+    double mean()
+    {
+        const double *p = this->posterior.data();
+        double sum = 0;
+        for (int i = 0; i < this->grid_size; i++)
+            sum += p[i] * i;
+        return this->grid_min + sum * this->grid_step;
+    }
+
+    // Threshold estimate in stimulus units.
+    double threshold()
+    {
+        return pow(10, this->mean());
+    }
+
+    // Sets the stimulus parameter to the posterior mean, before the first frame.
+    void apply()
+    {
+        int value = (int)lround(this->threshold());
+        value = max(this->min_intensity, min(this->max_intensity, value));
+        *this->intensity = value;
+        this->tested = (int)lround((log10((double)value) - this->grid_min) / this->grid_step);
+    }
+
+    void update(bool response)
+    {
+        // likelihood[tested - i + n - 1] for every candidate threshold i.
+        const double *likelihood = (response ? this->likelihood_yes.data() : this->likelihood_no.data()) + this->tested + this->grid_size - 1;
+        double *p = this->posterior.data();
+        for (int i = 0; i < this->grid_size; i++)
+            p[i] *= likelihood[-i];
+        this->normalize();
+        this->trials++;
+    }
+
+private:
+    void normalize()
+    {
+        double *p = this->posterior.data();
+        double sum = 0;
+        for (int i = 0; i < this->grid_size; i++)
+            sum += p[i];
+        for (int i = 0; i < this->grid_size; i++)
+            p[i] /= sum;
+    }
+};
+
+// Makes room for extra more elements, at least doubling the capacity when it
+// has to grow, so repeated calls stay amortized O(1) per element.
+template <typename T>
+void reserve_more(vector<T> *values, size_t extra)
+{
+    size_t needed = values->size() + extra;
+    if (needed > values->capacity())
+        values->reserve(max(needed, 2 * values->capacity()));
+}
+
+class Stimulus
+{
+public:
+    int FPS = 60;
+    int duration = 10;
+    int repetitions = 1;
+    int random_seed = 0;
+
+    vector<int> keys = {};
+    vector<session_time> timestamps = {};
+    vector<session_time> onsets = {};
+
+    int skip_key = KEY_ESCAPE;
+    Color background = RAYWHITE;
+
+    bool pick_once = false;
+
+    Staircase *staircase = 0;
+
+    // pick() draws only from rng and reads pick_index; pick_frame() sets
+    // both, so a frame is the same on any thread and in any order. The
+    // global rand() is left to the render thread (random new stimuli).
+    mt19937 rng;
+    int pick_index = 0; // 1-based frame within the repetition; 0 picks for the whole repetition
+
+    virtual ~Stimulus() {}
+
+    // A copy for a builder thread to pick and record on.
+    virtual Stimulus *clone(void) = 0;
+
+    virtual void pick(void) = 0;
+    // Describes the current frame; safe to call off the render thread.
+    virtual void record(vector<DrawCommand> *commands) = 0;
+    virtual Json::String to_json(void) = 0;
+    virtual std::string to_string() = 0;
+
+    // Called once before the first frame; heavy per-run setup goes here.
+    virtual void prepare(void) {}
+
+    // Upper bound on the commands record() adds for one frame.
+    virtual size_t command_count(void) { return 1; }
+
+    // The parameter an adaptive staircase varies, with its allowed range.
+    virtual int *intensity(int *min_intensity, int *max_intensity) = 0;
+
+    // Hash of everything draw() depends on for the current frame.
+    virtual uint64_t frame_hash(void) = 0;
+
+    vector<int> frame_counts = {};
+    vector<uint64_t> frame_hashes = {};
+
+    // Serialized once here; hashing and writing happen on library_writer.
+    LibraryWriter::File file()
+    {
+        Json::String json = this->to_json();
+        stringstream stream;
+        stream << hex << filesystem::hash_value(json);
+        return {"./files/stimuli/", stream.str() + ".json", json};
+    }
+
+    void save()
+    {
+        library_writer.save_all({this->file()});
+    }
+
+    // Frame index of repetition, or with index 0 the pick a pick_once
+    // stimulus keeps for the whole repetition.
+    void pick_frame(int repetition, int index)
+    {
+        int state[3] = {this->random_seed, repetition, index};
+        uint64_t seed = hash_words(hash_seed, state, sizeof(state));
+        this->rng.seed((uint32_t)(seed ^ (seed >> 32)));
+        this->pick_index = index;
+        this->pick();
+    }
+
+    vector<DrawCommand> draw_commands = {};
+
+    void draw()
+    {
+        this->draw_commands.clear();
+        this->record(&this->draw_commands);
+        submit(this->draw_commands);
+    }
+
+    void present()
+    {
+        int frame_end = (int)(this->duration * this->FPS);
+        int hold = 1;
+
+        // Every frame is held for a whole number of refreshes, one swap per
+        // refresh. Only swaps seen to lock to vblank pace themselves; with a
+        // merely reported rate the timer paces each swap at that rate.
+        if (display.is_measured)
+        {
+            hold = display.refreshes_per_frame(this->FPS);
+            frame_end = display.frames_for(this->duration, hold);
+            SetTargetFPS(display.is_vsynced ? 0 : (int)lround(display.refresh_hz));
+        }
+        else
+        {
+            SetTargetFPS(this->FPS);
+        }
+
+        if (this->staircase)
+            this->staircase->apply();
+        size_t first_key = this->keys.size();
+
+        this->prepare();
+
+        // At most one key is read per swap, so nothing below grows past these.
+        size_t frame_total = (size_t)frame_end * (this->repetitions + 1);
+        // They accumulate over the session, so grow them geometrically.
+        reserve_more(&this->keys, frame_total * hold);
+        reserve_more(&this->timestamps, frame_total * hold);
+        reserve_more(&this->onsets, frame_total);
+        this->frame_counts.assign(this->repetitions + 1, 0);
+        this->frame_hashes.clear();
+        this->frame_hashes.reserve(frame_total);
+
+        markers.trial++;
+
+        // Picking and recording run on the builder threads, each on its own
+        // copy; this thread only submits and swaps.
+        vector<Stimulus *> builders = {};
+        for (int w = 0; w < frame_pipeline.worker_count; w++)
+        {
+            builders.push_back(this->clone());
+            builders.back()->prepare();
+        }
+        int repetitions = this->repetitions;
+        frame_pipeline.begin([&builders, frame_end, repetitions](int worker, size_t number, FramePipeline::Frame *frame)
+                             {
+            if (frame_end <= 0 || number / frame_end > (size_t)repetitions)
+                return false;
+            int repetition = (int)(number / frame_end);
+            int index = (int)(number % frame_end) + 1;
+
+            allocation_tracker.begin_build();
+            Stimulus *builder = builders[worker];
+            builder->pick_frame(repetition, builder->pick_once ? 0 : index);
+            frame->commands.clear();
+            builder->record(&frame->commands);
+            frame->hash = builder->frame_hash();
+            frame->repetition = repetition;
+            frame->index = index;
+            allocation_tracker.end_build();
+            return true; }, this->command_count());
+
+        int repetition = 0;
+        int frame_count = 0;
+        FramePipeline::Frame *frame = 0;
+        while (!should_break && (frame = frame_pipeline.acquire()))
+        {
+            // A repetition ends at the flip that shows the next one.
+            int ended = -1, ended_count = 0;
+            if (frame->repetition != repetition)
+            {
+                if (frame_count > 0)
+                {
+                    ended = repetition;
+                    ended_count = frame_count;
+                }
+                repetition = frame->repetition;
+            }
+
+            frame_count = frame->index;
+            this->frame_hashes.push_back(frame->hash);
+            this->frame_counts[repetition] = frame_count;
+
+            // An acquired frame is always shown at least once.
+            for (int swap = 0; swap < hold && (swap == 0 || !should_break); swap++)
+            {
+                session_clock.tick();
+                allocation_tracker.begin_frame();
+                BeginDrawing();
+                ClearBackground(this->background);
+                submit(frame->commands);
+                session_time t_frame = session_clock.now();
+                int current_key = GetKeyPressed();
+
+                if (current_key)
+                {
+                    this->keys.push_back(current_key);
+                    this->timestamps.push_back(t_frame);
+                    markers.publish(MARKER_RESPONSE, current_key, frame_count, t_frame);
+                    if (current_key == this->skip_key)
+                        should_break = true;
+                }
+                EndDrawing();
+                if (swap == 0)
+                {
+                    this->onsets.push_back(session_clock.now());
+                    if (ended >= 0)
+                        markers.publish(MARKER_OFFSET, ended, ended_count, this->onsets.back());
+                    if (frame_count == 1)
+                        markers.publish(MARKER_ONSET, repetition, frame_count, this->onsets.back());
+                }
+
+                // Logged after the swap so console output never delays it.
+                if (current_key)
+                {
+                    cout << "Frame:    " << frame_count << endl;
+                    cout << "Key:      " << current_key << endl;
+                    cout << "Timestamp:" << TimeBase::to_ms(t_frame) << " ms" << endl;
+                }
+                allocation_tracker.end_frame();
+            }
+            frame_pipeline.release();
+        }
+        frame_pipeline.end();
+        for (Stimulus *builder : builders)
+            delete builder;
+
+        // The stimulus stays on screen until a blank frame replaces it; the
+        // offset is stamped at that flip.
+        if (frame_count > 0)
+        {
+            BeginDrawing();
+            ClearBackground(RAYWHITE);
+            EndDrawing();
+            markers.publish(MARKER_OFFSET, repetition, frame_count, session_clock.now());
+        }
+
+        // The menus are paced by the timer again, whatever present() set.
+        SetTargetFPS(screen_FPS);
+
+        if (session_log.is_recording)
+            session_log.record(this->to_json(), this->frame_counts, this->frame_hashes);
+
+        // An aborted or empty trial says nothing about the threshold.
+        if (this->staircase && !should_break && !this->frame_hashes.empty())
+        {
+            session_time t_start = session_clock.now();
+            bool response = find(this->keys.begin() + first_key, this->keys.end(), this->staircase->yes_key) != this->keys.end();
+            this->staircase->update(response);
+            cout << "Staircase: " << (response ? "yes" : "no") << ", threshold " << this->staircase->threshold()
+                 << " after " << this->staircase->trials << " trials, updated in "
+                 << TimeBase::to_ms(session_clock.now() - t_start) << " ms" << endl;
+        }
+    }
+
+    // Re-runs a logged presentation without a window swap: same seed, same
+    // picks and frame counts, drawing into target when one is given.
+    void replay(const vector<int> &counts, vector<uint64_t> *hashes, RenderTexture2D *target)
+    {
+        this->prepare();
+        hashes->clear();
+        for (int repetition = 0; repetition < (int)counts.size(); repetition++)
+        {
+            for (int f = 0; f < counts[repetition]; f++)
+            {
+                this->pick_frame(repetition, this->pick_once ? 0 : f + 1);
+                if (target)
+                {
+                    BeginTextureMode(*target);
+                    ClearBackground(this->background);
+                    this->draw();
+                    EndTextureMode();
+                }
+                hashes->push_back(this->frame_hash());
+            }
+        }
+    }
+};
+
+class Fixing : public Stimulus
+{
+public:
+    const char *sign = "+";
+    int font_size = 70;
+    int center_x = middle_x_screen;
+    int center_y = middle_y_screen;
+    Color color = LIGHTGRAY;
+
+    Fixing()
+    {
+        this->sign = "+";
+        this->font_size = 20 + rand() % 100;
+        this->center_x = middle_x_screen;
+        this->center_y = middle_y_screen;
+        this->pick_once = true;
+    }
+    Fixing(int font_size, int center_x, int center_y)
+    {
+        this->sign = "+";
+        this->font_size = font_size;
+        this->center_x = center_x;
+        this->center_y = center_y;
+        this->pick_once = true;
+    }
+    Stimulus *clone() override
+    {
+        return new Fixing(*this);
+    }
+    void pick() override
+    {
+    }
+
+    void record(vector<DrawCommand> *commands) override
+    {
+        commands->push_back({DRAW_TEXT, (float)this->center_x, (float)this->center_y, (float)this->font_size, this->color, this->sign, {}});
+    }
+
+    int *intensity(int *min_intensity, int *max_intensity) override
+    {
+        *min_intensity = 1;
+        *max_intensity = 1000;
+        return &this->font_size;
+    }
+
+    uint64_t frame_hash() override
+    {
+        int state[3] = {this->font_size, this->center_x, this->center_y};
+        uint64_t hash = hash_words(hash_seed, this->sign, strlen(this->sign));
+        hash = hash_words(hash, &this->color, sizeof(this->color));
+        return hash_words(hash, state, sizeof(state));
+    }
+
+    Json::String to_json()
+    {
+        Json::Value root;
+
+        root["type"] = "Fixing";
+        root["sign"] = this->sign;
+        root["font_size"] = this->font_size;
+        root["center_x"] = this->center_x;
+        root["center_y"] = this->center_y;
+        root["FPS"] = this->FPS;
+        root["duration"] = this->duration;
+        root["repetitions"] = this->repetitions;
+        root["random_seed"] = this->random_seed;
 
-typedef enum Screen
+        return root.toStyledString();
+    }
+
+    std::string to_string() override
+    {
+        std::string result = "Fixing(" +
+                             std::to_string(this->font_size) + "," +
+                             std::to_string(this->center_x) + "," +
+                             std::to_string(this->center_y) + "," +
+                             std::to_string(this->FPS) + "," +
+                             std::to_string(this->duration) + "," +
+                             std::to_string(this->repetitions) + "," +
+                             std::to_string(this->random_seed) +
+                             ")";
+        return result;
+    }
+
+    static Fixing from_json(Json::Value root)
+    {
+        Fixing s;
+
+        if (root["type"] == "Fixing")
+        {
+            // s.sign = root.isMember("sign") ? root["sign"].asCString() : "+";
+            s.sign = "+";
+            s.font_size = root.isMember("font_size") ? root["font_size"].asInt() : 1;
+            s.center_x = root.isMember("center_x") ? root["center_x"].asInt() : 1;
+            s.center_y = root.isMember("center_y") ? root["center_y"].asInt() : 1;
+            s.FPS = root.isMember("FPS") ? root["FPS"].asInt() : 60;
+            s.duration = root.isMember("duration") ? root["duration"].asInt() : 5;
+            s.repetitions = root.isMember("repetitions") ? root["repetitions"].asInt() : 1;
+            s.random_seed = root.isMember("random_seed") ? root["random_seed"].asInt() : 0;
+            s.pick_once = true;
+        }
+        else
+        {
+            cerr << "Failed to load file; incorrect type." << endl;
+        }
+
+        return s;
+    }
+};
+
+class RandomCircles : public Stimulus
 {
-    LOGO = 0,
-    MAIN,
-    EDITTING,
-    PRESENTING,
-    REPORT,
-    ENDING
-} Screen;
+public:
+    int n = 100;  // number of elements
+    int size = 5; // shape size
 
-typedef enum Stim
+    int inner_radius = 100;  // inner radius
+    int outter_radius = 200; // outter radius
+
+    vector<complex<double>> points = {};
+
+    Color color = BLACK;
+
+    RandomCircles()
+    {
+        this->n = 50 + rand() % 200;
+        this->size = 1 + rand() % 20;
+        this->inner_radius = 50 + rand() % 200;
+        this->inner_radius = 150 + rand() % 200;
+    }
+    RandomCircles(int n, int s, int irad, int orad, int FPS, int duration, int repetitions, int random_seed)
+    {
+        this->n = n;
+        this->size = s;
+        this->inner_radius = irad;
+        this->outter_radius = orad;
+
+        this->FPS = FPS;
+        this->duration = duration;
+        this->repetitions = repetitions;
+        this->random_seed = random_seed;
+    }
+    void prepare() override
+    {
+        // pick() runs on the builder thread; it should find the room already there.
+        this->points.reserve(this->n);
+    }
+
+    size_t command_count() override
+    {
+        return this->n;
+    }
+
+    Stimulus *clone() override
+    {
+        return new RandomCircles(*this);
+    }
+
+    void pick() override
+    {
+        // Only grows the buffer; re-picks at the same n reuse it.
+        this->points.resize(this->n);
+        for (int p = 0; p < this->n; p++)
+        {
+            double r = 0;
+            double theta = this->rng() % 360;
+
+            int diff_radius = this->outter_radius - this->inner_radius;
+
+            if (diff_radius <= 0)
+                r = this->inner_radius;
+            else
+                r = this->inner_radius + this->rng() % diff_radius;
+
+            this->points[p] = r * exp(1i * theta);
+        }
+    }
+
+    void record(vector<DrawCommand> *commands) override
+    {
+        for (int p = 0; p < this->n; p++)
+        {
+            commands->push_back({DRAW_CIRCLE, (float)(int)(real(this->points[p]) + middle_x_screen), (float)(int)(imag(this->points[p]) + middle_y_screen),
+                                 (float)this->size, this->color, 0, {}});
+        }
+    }
+
+    int *intensity(int *min_intensity, int *max_intensity) override
+    {
+        *min_intensity = 1;
+        *max_intensity = 1000;
+        return &this->n;
+    }
+
+    uint64_t frame_hash() override
+    {
+        int state[2] = {this->n, this->size};
+        uint64_t hash = hash_words(hash_seed, state, sizeof(state));
+        hash = hash_words(hash, &this->color, sizeof(this->color));
+        return hash_words(hash, this->points.data(), this->n * sizeof(this->points[0]));
+    }
+
+    Json::String to_json()
+    {
+        Json::Value root;
+
+        root["type"] = "RandomCircles";
+        root["n"] = this->n;
+        root["size"] = this->size;
+        root["inner_radius"] = this->inner_radius;
+        root["outter_radius"] = this->outter_radius;
+        root["FPS"] = this->FPS;
+        root["duration"] = this->duration;
+        root["repetitions"] = this->repetitions;
+        root["random_seed"] = this->random_seed;
+
+        return root.toStyledString();
+    }
+
+    string to_string() override
+    {
+        std::string result = "RandomCircles(" +
+                             std::to_string(this->n) + "," +
+                             std::to_string(this->size) + "," +
+                             std::to_string(this->inner_radius) + "," +
+                             std::to_string(this->outter_radius) + "," +
+                             std::to_string(this->FPS) + "," +
+                             std::to_string(this->duration) + "," +
+                             std::to_string(this->repetitions) + "," +
+                             std::to_string(this->random_seed) +
+                             ")";
+
+        return result;
+    }
+
+    static RandomCircles from_json(Json::Value root)
+    {
+        int f = 0;
+
+        RandomCircles rc;
+
+        if (root["type"] == "RandomCircles")
+        {
+            rc.n = root.isMember("n") ? root["n"].asInt() : 100;
+            rc.size = root.isMember("size") ? root["size"].asInt() : 5;
+            rc.inner_radius = root.isMember("inner_radius") ? root["inner_radius"].asInt() : 100;
+            rc.outter_radius = root.isMember("outter_radius") ? root["outter_radius"].asInt() : 120;
+            rc.FPS = root.isMember("FPS") ? root["FPS"].asInt() : 60;
+            rc.duration = root.isMember("duration") ? root["duration"].asInt() : 30;
+            rc.repetitions = root.isMember("repetitions") ? root["repetitions"].asInt() : 1;
+            rc.random_seed = root.isMember("random_seed") ? root["random_seed"].asInt() : 0;
+            rc.pick_once = false;
+        }
+        else
+        {
+            cerr << "Failed to load file; incorrect type." << endl;
+        }
+
+        return rc;
+    }
+};
+
+typedef enum Congruency
 {
-    FIXING,
-    RANDOM_CIRCLES,
-    COLORED_WORDS,
-} Stim;
+    ANY_CONGRUENCY = 0,
+    CONGRUENT,
+    INCONGRUENT,
+} Congruency;
 
-class Stimulus
+using word_color = pair<char const *, Color>;
+class ColoredWords : public Stimulus
 {
 public:
-    int FPS = 60;
-    int duration = 10;
-    int repetitions = 1;
-    int random_seed = 0;
+    int font_size = 20;
+    int word_index;
+    int color_index;
+    int congruency = ANY_CONGRUENCY;
 
-    vector<int> keys = {};
-    vector<double> timestamps = {};
+    vector<word_color> wc = {
+        word_color("Gray", GRAY),
+        word_color("Yellow", YELLOW),
+        word_color("Gold", GOLD),
+        word_color("Orange", ORANGE),
+        word_color("Pink", PINK),
+        word_color("Red", RED),
+        word_color("Maroon", MAROON),
+        word_color("Green", GREEN),
+        word_color("Lime", LIME),
+        word_color("Blue", BLUE),
+        word_color("Purple", PURPLE),
+        word_color("Violet", VIOLET),
+        word_color("Beige", BEIGE),
+        word_color("Brown", BROWN),
+        word_color("White", WHITE),
+        word_color("Black", BLACK),
+        word_color("Magenta", MAGENTA)};
 
-    int skip_key = KEY_ESCAPE;
-    Color background = RAYWHITE;
+    ColoredWords()
+    {
+        this->font_size = 20 + rand() % 100;
+        this->pick_once = true;
+    }
+    ColoredWords(int font_size)
+    {
+        this->font_size = font_size;
+        this->pick_once = true;
+    }
+    Stimulus *clone() override
+    {
+        return new ColoredWords(*this);
+    }
+    void pick()
+    {
+        word_index = this->rng() % wc.size();
+        if (congruency == CONGRUENT)
+            color_index = word_index;
+        else if (congruency == INCONGRUENT)
+            color_index = (word_index + 1 + this->rng() % (wc.size() - 1)) % wc.size();
+        else
+            color_index = this->rng() % wc.size();
+    }
+    void record(vector<DrawCommand> *commands) override
+    {
+        commands->push_back({DRAW_TEXT, (float)middle_x_screen, (float)middle_y_screen, (float)font_size, wc[color_index].second, wc[word_index].first, {}});
+    }
 
-    bool pick_once = false;
+    int *intensity(int *min_intensity, int *max_intensity) override
+    {
+        *min_intensity = 1;
+        *max_intensity = 1000;
+        return &this->font_size;
+    }
+
+    uint64_t frame_hash() override
+    {
+        int state[3] = {this->font_size, this->word_index, this->color_index};
+        return hash_words(hash_seed, state, sizeof(state));
+    }
+
+    Json::String to_json()
+    {
+        Json::Value root;
+
+        root["type"] = "ColoredWords";
+        root["font_size"] = this->font_size;
+        root["congruency"] = this->congruency;
+        root["FPS"] = this->FPS;
+        root["duration"] = this->duration;
+        root["repetitions"] = this->repetitions;
+        root["random_seed"] = this->random_seed;
+
+        return root.toStyledString();
+    }
+
+    std::string to_string() override
+    {
+        std::string result = "ColoredWords(" +
+                             std::to_string(this->font_size) + "," +
+                             std::to_string(this->congruency) + "," +
+                             std::to_string(this->FPS) + "," +
+                             std::to_string(this->duration) + "," +
+                             std::to_string(this->repetitions) + "," +
+                             std::to_string(this->random_seed) +
+                             ")";
+        return result;
+    }
+
+    static ColoredWords from_json(Json::Value root)
+    {
+        ColoredWords s;
+
+        if (root["type"] == "ColoredWords")
+        {
+            s.font_size = root.isMember("font_size") ? root["font_size"].asInt() : 20;
+            s.congruency = root.isMember("congruency") ? root["congruency"].asInt() : ANY_CONGRUENCY;
+            s.FPS = root.isMember("FPS") ? root["FPS"].asInt() : 60;
+            s.duration = root.isMember("duration") ? root["duration"].asInt() : 30;
+            // Older libraries saved this as "repetitionw".
+            s.repetitions = root.isMember("repetitions") ? root["repetitions"].asInt() : root.isMember("repetitionw") ? root["repetitionw"].asInt() : 1;
+            s.random_seed = root.isMember("random_seed") ? root["random_seed"].asInt() : 0;
+            s.pick_once = true;
+        }
+        else
+        {
+            cerr << "Failed to load file; incorrect type." << endl;
+        }
+
+        return s;
+    }
+};
+// Procedural textures are generated on the CPU before the run and kept on the
+// GPU, keyed by their parameters, so presenting them only blits. The cache is
+// bounded by texture bytes and evicts the least recently used rings first;
+// rings still held by a stimulus are never evicted.
+// Every generated pixel buffer is hashed once; frame hashes fold that in so
+// --replay notices a kernel that no longer produces the same pixels.
+struct TextureRing
+{
+    vector<Texture2D> textures;
+    uint64_t content_hash;
+    size_t bytes;
+    uint64_t last_used;
+};
 
-    virtual void pick(void) = 0;
-    virtual void draw(void) = 0;
-    virtual Json::String to_json(void) = 0;
-    virtual std::string to_string() = 0;
+unordered_map<string, shared_ptr<TextureRing>> texture_cache = {};
+const size_t texture_cache_limit = 256 << 20; // bytes
+size_t texture_cache_bytes = 0;
+uint64_t texture_cache_clock = 0;
 
-    void save()
+shared_ptr<TextureRing> cached_textures(string key, int width, int height, int frames,
+                                        function<void(unsigned char *, int, int, int)> kernel)
+{
+    auto found = texture_cache.find(key);
+    if (found != texture_cache.end())
     {
-        stringstream stream;
-        stream << hex << filesystem::hash_value(this->to_json());
-        string filename(stream.str());
-        ofstream file = ofstream("./files/stimuli/" + filename + ".json", ios::out);
-        file << this->to_json();
-        file.close();
+        found->second->last_used = ++texture_cache_clock;
+        return found->second;
     }
 
-    void present()
+    // Only rings the cache alone holds can go; if every ring is in use, or
+    // one ring is larger than the whole budget, the cache runs over it.
+    size_t bytes = (size_t)width * height * frames;
+    while (texture_cache_bytes + bytes > texture_cache_limit)
     {
-        int frame_end = (int)(this->duration * this->FPS);
+        auto oldest = texture_cache.end();
+        for (auto entry = texture_cache.begin(); entry != texture_cache.end(); entry++)
+            if (entry->second.use_count() == 1 && (oldest == texture_cache.end() || entry->second->last_used < oldest->second->last_used))
+                oldest = entry;
+        if (oldest == texture_cache.end())
+            break;
+        for (Texture2D texture : oldest->second->textures)
+            UnloadTexture(texture);
+        texture_cache_bytes -= oldest->second->bytes;
+        texture_cache.erase(oldest);
+    }
 
-        SetTargetFPS(this->FPS);
+    session_time t_start = session_clock.now();
 
-        srand(this->random_seed);
-        for (int r = 0; r <= this->repetitions; r++)
+    vector<unsigned char> pixels(width * height);
+    vector<Texture2D> textures = {};
+    uint64_t hash = hash_words(hash_seed, key.data(), key.size());
+    int workers = max(1, min((int)thread::hardware_concurrency(), height / 16));
+
+    for (int f = 0; f < frames; f++)
+    {
+        vector<thread> threads = {};
+        for (int w = 0; w < workers; w++)
         {
-            int frame_count = 0;
+            int row_begin = height * w / workers;
+            int row_end = height * (w + 1) / workers;
+            threads.push_back(thread(kernel, pixels.data(), f, row_begin, row_end));
+        }
+        for (thread &t : threads)
+            t.join();
+        hash = hash_words(hash, pixels.data(), pixels.size());
+
+        Image image = {
+            .data = pixels.data(),
+            .width = width,
+            .height = height,
+            .mipmaps = 1,
+            .format = PIXELFORMAT_UNCOMPRESSED_GRAYSCALE,
+        };
+        textures.push_back(LoadTextureFromImage(image));
+    }
 
-            auto t_start = chrono::high_resolution_clock::now();
+    cout << "Generated " << frames << " texture(s) for " << key << " in "
+         << TimeBase::to_ms(session_clock.now() - t_start) << " ms" << endl;
 
-            this->pick();
-            while (!should_break && (frame_count < frame_end))
-            {
-                frame_count++;
-                BeginDrawing();
-                ClearBackground(this->background);
-                if (!this->pick_once)
-                {
-                    this->pick();
-                }
-                this->draw();
-                auto t_frame = chrono::high_resolution_clock::now();
-                int current_key = GetKeyPressed();
+    texture_cache_bytes += bytes;
+    return texture_cache[key] = make_shared<TextureRing>(TextureRing{textures, hash, bytes, ++texture_cache_clock});
+}
 
-                if (current_key)
-                {
-                    double timestamp = (t_frame - t_start).count();
-                    this->keys.push_back(current_key);
-                    this->timestamps.push_back(timestamp);
+// Sine grating, or a Gabor patch when sigma > 0. The carrier
+// cos(a(x) + b(y)) is split into per-column and per-row cos/sin tables so
+// the per-pixel work is a few multiply-adds the compiler vectorizes.
+class Grating : public Stimulus
+{
+public:
+    int size = 256;      // texture side in pixels
+    int cycles = 8;      // carrier cycles across the texture
+    int orientation = 0; // degrees
+    int contrast = 100;  // percent
+    int sigma = 0;       // gaussian envelope in pixels; 0 means no envelope
+    int drift = 0;       // cycles per second
 
-                    cout << "Frame:    " << frame_count << endl;
-                    cout << "Key:      " << current_key << endl;
-                    cout << "Timestamp:" << timestamp << endl;
+    int frame = 0;
+    shared_ptr<TextureRing> frames = nullptr;
 
-                    if (current_key == this->skip_key)
-                        should_break = true;
-                }
-                EndDrawing();
-            }
-            ClearBackground(RAYWHITE);
-        }
+    Grating()
+    {
+        this->background = (Color){128, 128, 128, 255};
+    }
+    Grating(int size, int cycles, int orientation, int contrast, int sigma, int drift)
+    {
+        this->size = size;
+        this->cycles = cycles;
+        this->orientation = orientation;
+        this->contrast = contrast;
+        this->sigma = sigma;
+        this->drift = drift;
+        this->background = (Color){128, 128, 128, 255};
     }
-};
 
-class Fixing : public Stimulus
-{
-public:
-    const char *sign = "+";
-    int font_size = 70;
-    int center_x = middle_x_screen;
-    int center_y = middle_y_screen;
-    Color color = LIGHTGRAY;
+    int ring_size()
+    {
+        // One drift cycle, rendered at the stimulus frame rate.
+        if (this->drift <= 0)
+            return 1;
+        return max(1, min(240, this->FPS / this->drift));
+    }
 
-    Fixing()
+    void prepare() override
     {
-        this->sign = "+";
-        this->font_size = 20 + rand() % 100;
-        this->center_x = middle_x_screen;
-        this->center_y = middle_y_screen;
-        this->pick_once = true;
+        int ring = this->ring_size();
+        int n = this->size;
+        float frequency = 2 * PI * this->cycles / n;
+        float theta = this->orientation * DEG2RAD;
+        float c = this->contrast / 100.0f;
+        float s = this->sigma;
+
+        string key = "Grating(" + std::to_string(n) + "," + std::to_string(this->cycles) + "," +
+                     std::to_string(this->orientation) + "," + std::to_string(this->contrast) + "," +
+                     std::to_string(this->sigma) + "," + std::to_string(ring) + ")";
+
+        this->frames = cached_textures(key, n, n, ring, [=](unsigned char *pixels, int f, int row_begin, int row_end)
+                                       {
+            float phase = 2 * PI * f / ring;
+            vector<float> cx(n), sx(n), ex(n);
+            for (int x = 0; x < n; x++)
+            {
+                float u = x - n / 2.0f;
+                cx[x] = cosf(frequency * u * cosf(theta) + phase);
+                sx[x] = sinf(frequency * u * cosf(theta) + phase);
+                ex[x] = s > 0 ? expf(-u * u / (2 * s * s)) : 1.0f;
+            }
+            for (int y = row_begin; y < row_end; y++)
+            {
+                float v = y - n / 2.0f;
+                float cy = cosf(frequency * v * sinf(theta));
+                float sy = sinf(frequency * v * sinf(theta));
+                float ey = (s > 0 ? expf(-v * v / (2 * s * s)) : 1.0f) * 127.5f * c;
+                // Locals keep the byte stores from aliasing the tables and bound.
+                const float *pcx = cx.data(), *psx = sx.data(), *pex = ex.data();
+                const int width = n;
+                unsigned char *row = pixels + (size_t)y * width;
+                // Needs -fopenmp-simd; -O2 alone does not vectorize loops.
+#pragma omp simd
+                for (int x = 0; x < width; x++)
+                {
+                    row[x] = (unsigned char)(127.5f + (pcx[x] * cy - psx[x] * sy) * pex[x] * ey);
+                }
+            } });
+
+        this->frame = 0;
+        this->pick_once = ring == 1;
     }
-    Fixing(int font_size, int center_x, int center_y)
+
+    Stimulus *clone() override
     {
-        this->sign = "+";
-        this->font_size = font_size;
-        this->center_x = center_x;
-        this->center_y = center_y;
-        this->pick_once = true;
+        return new Grating(*this);
     }
+
+    // Every repetition starts the ring over at its first frame.
     void pick() override
     {
+        if (this->frames)
+            this->frame = max(0, this->pick_index - 1) % this->frames->textures.size();
     }
 
-    void draw() override
+    void record(vector<DrawCommand> *commands) override
     {
-        DrawText(this->sign, this->center_x, this->center_y, this->font_size, this->color);
+        if (this->frames)
+            commands->push_back({DRAW_TEXTURE, (float)(middle_x_screen - this->size / 2), (float)(middle_y_screen - this->size / 2), 0, WHITE, 0, this->frames->textures[this->frame]});
+    }
+
+    int *intensity(int *min_intensity, int *max_intensity) override
+    {
+        *min_intensity = 1;
+        *max_intensity = 100;
+        return &this->contrast;
+    }
+
+    uint64_t frame_hash() override
+    {
+        int64_t state[3] = {this->frames ? (int64_t)this->frames->content_hash : 0, this->frame, this->size};
+        return hash_words(hash_seed, state, sizeof(state));
     }
 
     Json::String to_json()
     {
         Json::Value root;
 
-        root["type"] = "Fixing";
-        root["sign"] = this->sign;
-        root["font_size"] = this->font_size;
-        root["center_x"] = this->center_x;
-        root["center_y"] = this->center_y;
+        root["type"] = "Grating";
+        root["size"] = this->size;
+        root["cycles"] = this->cycles;
+        root["orientation"] = this->orientation;
+        root["contrast"] = this->contrast;
+        root["sigma"] = this->sigma;
+        root["drift"] = this->drift;
         root["FPS"] = this->FPS;
         root["duration"] = this->duration;
         root["repetitions"] = this->repetitions;
@@ -179,10 +2657,13 @@ public:
 
     std::string to_string() override
     {
-        std::string result = "Fixing(" +
-                             std::to_string(this->font_size) + "," +
-                             std::to_string(this->center_x) + "," +
-                             std::to_string(this->center_y) + "," +
+        std::string result = "Grating(" +
+                             std::to_string(this->size) + "," +
+                             std::to_string(this->cycles) + "," +
+                             std::to_string(this->orientation) + "," +
+                             std::to_string(this->contrast) + "," +
+                             std::to_string(this->sigma) + "," +
+                             std::to_string(this->drift) + "," +
                              std::to_string(this->FPS) + "," +
                              std::to_string(this->duration) + "," +
                              std::to_string(this->repetitions) + "," +
@@ -191,105 +2672,147 @@ public:
         return result;
     }
 
-    static Fixing from_json(Json::Value root)
+    static Grating from_json(Json::Value root)
     {
-        Fixing *s = new Fixing;
+        Grating g;
 
-        if (root["type"] == "Fixing")
+        if (root["type"] == "Grating")
         {
-            // s->sign = root.isMember("sign") ? root["sign"].asCString() : "+";
-            s->sign = "+";
-            s->font_size = root.isMember("font_size") ? root["font_size"].asInt() : 1;
-            s->center_x = root.isMember("center_x") ? root["center_x"].asInt() : 1;
-            s->center_y = root.isMember("center_Y") ? root["center_Y"].asInt() : 1;
-            s->FPS = root.isMember("FPS") ? root["FPS"].asInt() : 60;
-            s->duration = root.isMember("duration") ? root["duration"].asInt() : 5;
-            s->repetitions = root.isMember("repetitions") ? root["repetitions"].asInt() : 1;
-            s->random_seed = root.isMember("random_seed") ? root["random_seed"].asInt() : 0;
-            s->pick_once = true;
+            g.size = root.isMember("size") ? root["size"].asInt() : 256;
+            g.cycles = root.isMember("cycles") ? root["cycles"].asInt() : 8;
+            g.orientation = root.isMember("orientation") ? root["orientation"].asInt() : 0;
+            g.contrast = root.isMember("contrast") ? root["contrast"].asInt() : 100;
+            g.sigma = root.isMember("sigma") ? root["sigma"].asInt() : 0;
+            g.drift = root.isMember("drift") ? root["drift"].asInt() : 0;
+            g.FPS = root.isMember("FPS") ? root["FPS"].asInt() : 60;
+            g.duration = root.isMember("duration") ? root["duration"].asInt() : 5;
+            g.repetitions = root.isMember("repetitions") ? root["repetitions"].asInt() : 1;
+            g.random_seed = root.isMember("random_seed") ? root["random_seed"].asInt() : 0;
         }
         else
         {
             cerr << "Failed to load file; incorrect type." << endl;
         }
 
-        return *s;
+        return g;
     }
 };
 
-class RandomCircles : public Stimulus
+// Uniform white noise mask. Pixels come from an integer hash of
+// (seed, frame, cell), so rows can be generated independently and in lanes.
+class NoiseMask : public Stimulus
 {
 public:
-    int n = 100;  // number of elements
-    int size = 5; // shape size
-
-    int inner_radius = 100;  // inner radius
-    int outter_radius = 200; // outter radius
-
-    complex<double> *points = new complex<double>[100];
+    int size = 256;     // texture side in pixels
+    int grain = 4;      // noise cell side in pixels
+    int contrast = 100; // percent
+    int ring = 1;       // distinct noise frames cycled during presentation
 
-    Color color = BLACK;
+    int frame = 0;
+    shared_ptr<TextureRing> frames = nullptr;
 
-    RandomCircles()
+    NoiseMask()
     {
-        this->n = 50 + rand() % 200;
-        this->size = 1 + rand() % 20;
-        this->inner_radius = 50 + rand() % 200;
-        this->inner_radius = 150 + rand() % 200;
+        this->background = (Color){128, 128, 128, 255};
     }
-    RandomCircles(int n, int s, int irad, int orad, int FPS, int duration, int repetitions, int random_seed)
+    NoiseMask(int size, int grain, int contrast, int ring)
     {
-        this->n = n;
-        this->size = s;
-        this->inner_radius = irad;
-        this->outter_radius = orad;
+        this->size = size;
+        this->grain = grain;
+        this->contrast = contrast;
+        this->ring = ring;
+        this->background = (Color){128, 128, 128, 255};
+    }
 
-        this->FPS = FPS;
-        this->duration = duration;
-        this->repetitions = repetitions;
-        this->random_seed = random_seed;
+    void prepare() override
+    {
+        int n = this->size;
+        int g = max(1, this->grain);
+        int ring = max(1, min(240, this->ring));
+        float c = this->contrast / 100.0f;
+        unsigned int seed = this->random_seed;
+
+        string key = "NoiseMask(" + std::to_string(n) + "," + std::to_string(g) + "," +
+                     std::to_string(this->contrast) + "," + std::to_string(ring) + "," +
+                     std::to_string(this->random_seed) + ")";
+
+        this->frames = cached_textures(key, n, n, ring, [=](unsigned char *pixels, int f, int row_begin, int row_end)
+                                       {
+            // One hash per noise cell, vectorized across the cells of a row,
+            // then widened to pixels and reused for the rows of that cell.
+            const int width = n, cell = g, cells = (n + g - 1) / g;
+            const float gain = c;
+            vector<unsigned char> values(cells);
+            for (int y = row_begin; y < row_end; y++)
+            {
+                unsigned char *row = pixels + (size_t)y * width;
+                if (y != row_begin && y % cell != 0)
+                {
+                    memcpy(row, row - width, width);
+                    continue;
+                }
+
+                unsigned int base = (seed * 0x9E3779B1u) ^ ((unsigned int)f * 0x85EBCA77u) ^ ((unsigned int)(y / cell) * cells);
+                unsigned char *pv = values.data();
+#pragma omp simd
+                for (int v = 0; v < cells; v++)
+                {
+                    unsigned int h = base + (unsigned int)v;
+                    h ^= h >> 16;
+                    h *= 0x7FEB352Du;
+                    h ^= h >> 15;
+                    h *= 0x846CA68Bu;
+                    h ^= h >> 16;
+                    pv[v] = (unsigned char)(127.5f + ((float)(h & 0xFF) - 127.5f) * gain);
+                }
+                for (int x = 0; x < width; x++)
+                    row[x] = pv[x / cell];
+            } });
+
+        this->frame = 0;
+        this->pick_once = ring == 1;
     }
-    ~RandomCircles()
+
+    Stimulus *clone() override
     {
-        delete[] points;
+        return new NoiseMask(*this);
     }
 
+    // Every repetition starts the ring over at its first frame.
     void pick() override
     {
-        this->points = new complex<double>[this->n];
-        for (int p = 0; p < this->n; p++)
-        {
-            double r = 0;
-            double theta = rand() % 360;
-
-            int diff_radius = this->outter_radius - this->inner_radius;
+        if (this->frames)
+            this->frame = max(0, this->pick_index - 1) % this->frames->textures.size();
+    }
 
-            if (diff_radius <= 0)
-                r = this->inner_radius;
-            else
-                r = this->inner_radius + rand() % diff_radius;
+    void record(vector<DrawCommand> *commands) override
+    {
+        if (this->frames)
+            commands->push_back({DRAW_TEXTURE, (float)(middle_x_screen - this->size / 2), (float)(middle_y_screen - this->size / 2), 0, WHITE, 0, this->frames->textures[this->frame]});
+    }
 
-            this->points[p] = r * exp(1i * theta);
-        }
+    int *intensity(int *min_intensity, int *max_intensity) override
+    {
+        *min_intensity = 1;
+        *max_intensity = 100;
+        return &this->contrast;
     }
 
-    void draw() override
+    uint64_t frame_hash() override
     {
-        for (int p = 0; p < this->n; p++)
-        {
-            DrawCircle(real(this->points[p]) + middle_x_screen, imag(this->points[p]) + middle_y_screen, this->size, this->color);
-        }
+        int64_t state[3] = {this->frames ? (int64_t)this->frames->content_hash : 0, this->frame, this->size};
+        return hash_words(hash_seed, state, sizeof(state));
     }
 
     Json::String to_json()
     {
         Json::Value root;
 
-        root["type"] = "RandomCircles";
-        root["n"] = this->n;
+        root["type"] = "NoiseMask";
         root["size"] = this->size;
-        root["inner_radius"] = this->inner_radius;
-        root["outter_radius"] = this->outter_radius;
+        root["grain"] = this->grain;
+        root["contrast"] = this->contrast;
+        root["ring"] = this->ring;
         root["FPS"] = this->FPS;
         root["duration"] = this->duration;
         root["repetitions"] = this->repetitions;
@@ -298,182 +2821,572 @@ public:
         return root.toStyledString();
     }
 
-    string to_string() override
+    std::string to_string() override
     {
-        std::string result = "RandomCircles(" +
-                             std::to_string(this->n) + "," +
+        std::string result = "NoiseMask(" +
                              std::to_string(this->size) + "," +
-                             std::to_string(this->inner_radius) + "," +
-                             std::to_string(this->outter_radius) + "," +
+                             std::to_string(this->grain) + "," +
+                             std::to_string(this->contrast) + "," +
+                             std::to_string(this->ring) + "," +
                              std::to_string(this->FPS) + "," +
                              std::to_string(this->duration) + "," +
                              std::to_string(this->repetitions) + "," +
                              std::to_string(this->random_seed) +
                              ")";
+        return result;
+    }
+
+    static NoiseMask from_json(Json::Value root)
+    {
+        NoiseMask m;
+
+        if (root["type"] == "NoiseMask")
+        {
+            m.size = root.isMember("size") ? root["size"].asInt() : 256;
+            m.grain = root.isMember("grain") ? root["grain"].asInt() : 4;
+            m.contrast = root.isMember("contrast") ? root["contrast"].asInt() : 100;
+            m.ring = root.isMember("ring") ? root["ring"].asInt() : 1;
+            m.FPS = root.isMember("FPS") ? root["FPS"].asInt() : 60;
+            m.duration = root.isMember("duration") ? root["duration"].asInt() : 5;
+            m.repetitions = root.isMember("repetitions") ? root["repetitions"].asInt() : 1;
+            m.random_seed = root.isMember("random_seed") ? root["random_seed"].asInt() : 0;
+        }
+        else
+        {
+            cerr << "Failed to load file; incorrect type." << endl;
+        }
+
+        return m;
+    }
+};
+
+class Trial
+{
+public:
+    Stimulus *stimulus = 0;
+    int condition = 0;
+    int block = 0;
+    int seed = 0;
+    int congruency = ANY_CONGRUENCY;
+
+    void run()
+    {
+        int seed = this->stimulus->random_seed;
+        ColoredWords *cw = dynamic_cast<ColoredWords *>(this->stimulus);
+        int congruency = cw ? cw->congruency : ANY_CONGRUENCY;
+
+        this->stimulus->random_seed = this->seed;
+        if (cw)
+            cw->congruency = this->congruency;
+
+        this->stimulus->present();
+
+        this->stimulus->random_seed = seed;
+        if (cw)
+            cw->congruency = congruency;
+    }
+};
+
+// Builds the presentation order out of the conditions in exp_stimuli. Every
+// condition is repeated, conditions are grouped into blocks whose order is
+// counterbalanced across participants with a balanced Latin square, and each
+// block is shuffled so that no condition runs more than max_run times in a
+// row. ColoredWords conditions are split into congruent/incongruent halves,
+// and max_congruency_run optionally limits runs of the same congruency.
+class TrialSequence
+{
+public:
+    int repeats = 10;
+    int blocks = 1;
+    int max_run = 2;
+    int max_congruency_run = INT_MAX; // INT_MAX leaves congruency runs free
+    bool balance_congruency = true;
+    int participant = 0;
+    int seed = 0;
+
+    vector<Trial> generate(const vector<Stimulus *> &conditions)
+    {
+        vector<Trial> trials = {};
+        if (conditions.empty())
+            return trials;
+
+        seed_seq seq = {this->seed, this->participant};
+        mt19937 rng(seq);
+
+        int block_count = max(1, min(this->blocks, (int)conditions.size()));
+        vector<int> block_order = latin_square_row(block_count, this->participant);
+
+        // Each key is a condition, or a (condition, congruency) pair.
+        vector<int> key_condition = {};
+        vector<int> key_congruency = {};
+        vector<int> key_count = {};
+        vector<vector<int>> block_keys(block_count);
+        for (size_t c = 0; c < conditions.size(); c++)
+        {
+            int b = c % block_count;
+            if (this->balance_congruency && dynamic_cast<ColoredWords *>(conditions[c]))
+            {
+                // Odd repeats give the spare trial to alternating participants.
+                int congruent = (this->repeats + (this->participant % 2)) / 2;
+                int counts[2] = {congruent, this->repeats - congruent};
+                int kinds[2] = {CONGRUENT, INCONGRUENT};
+                for (int k = 0; k < 2; k++)
+                {
+                    block_keys[b].push_back(key_count.size());
+                    key_condition.push_back(c);
+                    key_congruency.push_back(kinds[k]);
+                    key_count.push_back(counts[k]);
+                }
+            }
+            else
+            {
+                block_keys[b].push_back(key_count.size());
+                key_condition.push_back(c);
+                key_congruency.push_back(ANY_CONGRUENCY);
+                key_count.push_back(this->repeats);
+            }
+        }
+
+        trials.reserve(conditions.size() * this->repeats);
+
+        // Runs are limited per condition, and optionally per congruency
+        // (trials without one break congruency runs). Both are tracked
+        // across blocks.
+        RunConstraint by_condition = {{}, (int)conditions.size(), this->max_run};
+        RunConstraint by_congruency = {{}, 2, this->max_congruency_run};
+
+        vector<int> order = {};
+        for (int b : block_order)
+        {
+            vector<int> counts = {};
+            by_condition.group.clear();
+            by_congruency.group.clear();
+            for (int k : block_keys[b])
+            {
+                counts.push_back(key_count[k]);
+                by_condition.group.push_back(key_condition[k]);
+                by_congruency.group.push_back(key_congruency[k] == CONGRUENT ? 0 : key_congruency[k] == INCONGRUENT ? 1 : -1);
+            }
+
+            vector<RunConstraint> constraints = {by_condition};
+            if (this->max_congruency_run < INT_MAX)
+                constraints = {by_condition, by_congruency};
+
+            // Joint constraints can run out of backtracking budget; a fresh draw usually succeeds.
+            bool shuffled = constrained_shuffle(counts, &constraints, rng, &order);
+            for (int attempt = 1; !shuffled && constraints.size() > 1 && attempt < 8; attempt++)
+            {
+                constraints = {by_condition, by_congruency};
+                shuffled = constrained_shuffle(counts, &constraints, rng, &order);
+            }
+            if (!shuffled && constraints.size() > 1)
+            {
+                cerr << "Block " << b << " cannot satisfy max_congruency_run " << this->max_congruency_run << " together with max_run; ignoring it." << endl;
+                constraints = {by_condition};
+                shuffled = constrained_shuffle(counts, &constraints, rng, &order);
+            }
+            if (!shuffled)
+            {
+                cerr << "Block " << b << " cannot satisfy max_run " << this->max_run << "; ordering it unconstrained." << endl;
+                constraints.clear();
+                constrained_shuffle(counts, &constraints, rng, &order);
+            }
+
+            // Carry the runs at the end of this block into the next one.
+            for (int o : order)
+            {
+                int k = block_keys[b][o];
+                by_condition.advance(key_condition[k]);
+                by_congruency.advance(key_congruency[k] == CONGRUENT ? 0 : key_congruency[k] == INCONGRUENT ? 1 : -1);
+
+                Trial t;
+                t.stimulus = conditions[key_condition[k]];
+                t.condition = key_condition[k];
+                t.block = b;
+                t.seed = rng() % 1000000;
+                t.congruency = key_congruency[k];
+                trials.push_back(t);
+            }
+        }
+
+        return trials;
+    }
 
+    // Row `row` of a balanced (Williams) Latin square of size n; odd n uses
+    // the mirrored rows for the second half of the participants.
+    static vector<int> latin_square_row(int n, int row)
+    {
+        vector<int> result(n);
+        int r = row % n;
+        for (int j = 0; j < n; j++)
+        {
+            int offset = (j % 2 == 0) ? j / 2 : n - (j + 1) / 2;
+            result[j] = (r + offset) % n;
+        }
+        if (n % 2 == 1 && (row / n) % 2 == 1)
+            reverse(result.begin(), result.end());
         return result;
     }
 
-    static RandomCircles from_json(Json::Value root)
+    // Limits how many keys of the same group may follow each other; keys
+    // with group -1 belong to no group and end any run.
+    struct RunConstraint
+    {
+        vector<int> group; // per key
+        int groups;
+        int max_run;
+        int last = -1; // group of the last placed trial
+        int run = 0;
+
+        void advance(int g)
+        {
+            this->run = (g >= 0 && g == this->last) ? this->run + 1 : 1;
+            this->last = g;
+        }
+    };
+
+    // Sequential sampling proportional to the remaining counts, restricted to
+    // the keys that keep every remaining group placeable without a run longer
+    // than its max_run. With a single constraint that check is exact and the
+    // shuffle never backtracks; a rejected draw costs one more check, so the
+    // worst case is O(trials * keys^2). Two constraints can still reach a
+    // dead end, which is undone by backtracking over the last placements
+    // within a bounded budget; past it this returns false. On success the
+    // constraints' last and run describe the end of order.
+    static bool constrained_shuffle(vector<int> counts, vector<RunConstraint> *constraints, mt19937 &rng, vector<int> *order)
+    {
+        int keys = counts.size();
+        long total = 0;
+        for (int c : counts)
+            total += c;
+
+        order->clear();
+        order->reserve(total);
+
+        vector<long> sizes = {};
+        auto feasible = [&](const RunConstraint &constraint, int g_last, int g_run)
+        {
+            sizes.assign(constraint.groups, 0);
+            for (int k = 0; k < keys; k++)
+                if (constraint.group[k] >= 0)
+                    sizes[constraint.group[k]] += counts[k];
+            for (int g = 0; g < constraint.groups; g++)
+            {
+                long others = total - sizes[g];
+                long slots = (long)constraint.max_run * (others + 1);
+                if (g == g_last)
+                    slots -= g_run;
+                if (sizes[g] > slots)
+                    return false;
+            }
+            return true;
+        };
+
+        for (const RunConstraint &constraint : *constraints)
+            if (!feasible(constraint, constraint.last, constraint.run))
+                return false;
+
+        // Keys ruled out at each position, and the runs before each placement.
+        long length = total;
+        vector<vector<int>> excluded(length + 1);
+        vector<pair<int, int>> saved = {};
+        size_t per_level = constraints->size();
+        saved.reserve(length * per_level);
+        long budget = 64 * length + 1024;
+
+        auto allowed = [&](int k)
+        {
+            const vector<int> &ruled_out = excluded[order->size()];
+            if (counts[k] <= 0 || find(ruled_out.begin(), ruled_out.end(), k) != ruled_out.end())
+                return false;
+            for (const RunConstraint &constraint : *constraints)
+            {
+                int g = constraint.group[k];
+                if (g >= 0 && g == constraint.last && constraint.run >= constraint.max_run)
+                    return false;
+            }
+            return true;
+        };
+
+        while (total > 0)
+        {
+            long weight = 0;
+            for (int k = 0; k < keys; k++)
+                if (allowed(k))
+                    weight += counts[k];
+
+            if (weight == 0)
+            {
+                // Dead end: take back the last placement and rule it out there.
+                if (order->empty() || --budget < 0)
+                    return false;
+                excluded[order->size()].clear();
+                int k = order->back();
+                order->pop_back();
+                counts[k]++;
+                total++;
+                for (size_t c = 0; c < per_level; c++)
+                {
+                    (*constraints)[c].last = saved[saved.size() - per_level + c].first;
+                    (*constraints)[c].run = saved[saved.size() - per_level + c].second;
+                }
+                saved.resize(saved.size() - per_level);
+                excluded[order->size()].push_back(k);
+                continue;
+            }
+
+            long r = rng() % weight;
+            int k = 0;
+            for (; k < keys; k++)
+            {
+                if (!allowed(k))
+                    continue;
+                if (r < counts[k])
+                    break;
+                r -= counts[k];
+            }
+
+            counts[k]--;
+            total--;
+            bool fits = true;
+            for (const RunConstraint &constraint : *constraints)
+            {
+                int g = constraint.group[k];
+                int g_run = (g >= 0 && g == constraint.last) ? constraint.run + 1 : 1;
+                if (!feasible(constraint, g, g_run))
+                {
+                    fits = false;
+                    break;
+                }
+            }
+
+            if (!fits)
+            {
+                counts[k]++;
+                total++;
+                excluded[order->size()].push_back(k);
+                continue;
+            }
+
+            for (RunConstraint &constraint : *constraints)
+            {
+                saved.push_back(make_pair(constraint.last, constraint.run));
+                constraint.advance(constraint.group[k]);
+            }
+            order->push_back(k);
+            excluded[order->size()].clear();
+        }
+        return true;
+    }
+
+    void save(const vector<Trial> &trials)
     {
-        int f = 0;
-
-        RandomCircles *rc = new RandomCircles();
-
-        if (root["type"] == "RandomCircles")
-        {
-            rc->n = root.isMember("n") ? root["n"].asInt() : 100;
-            rc->size = root.isMember("size") ? root["size"].asInt() : 5;
-            rc->inner_radius = root.isMember("inner_radius") ? root["inner_radius"].asInt() : 100;
-            rc->outter_radius = root.isMember("outter_radius") ? root["outter_radius"].asInt() : 120;
-            rc->FPS = root.isMember("FPS") ? root["FPS"].asInt() : 60;
-            rc->duration = root.isMember("duration") ? root["duration"].asInt() : 30;
-            rc->repetitions = root.isMember("repetitions") ? root["repetitions"].asInt() : 1;
-            rc->random_seed = root.isMember("random_seed") ? root["random_seed"].asInt() : 0;
-            rc->pick_once = false;
-        }
-        else
+        Json::Value root;
+        root["participant"] = this->participant;
+        root["seed"] = this->seed;
+        root["repeats"] = this->repeats;
+        root["blocks"] = this->blocks;
+        root["max_run"] = this->max_run;
+        root["max_congruency_run"] = this->max_congruency_run;
+        for (const Trial &t : trials)
         {
-            cerr << "Failed to load file; incorrect type." << endl;
+            Json::Value trial;
+            trial["stimulus"] = t.stimulus->to_string();
+            trial["condition"] = t.condition;
+            trial["block"] = t.block;
+            trial["seed"] = t.seed;
+            trial["congruency"] = t.congruency;
+            root["trials"].append(trial);
         }
 
-        return *rc;
+        ofstream file = ofstream("./files/experiments/participant_" + std::to_string(this->participant) + ".json", ios::out);
+        file << root.toStyledString();
+        file.close();
     }
 };
 
-using word_color = pair<char const *, Color>;
-class ColoredWords : public Stimulus
+// Drives the stimulus intensity adaptively from now on, restarting any
+// staircase it already had.
+void attach_staircase(Stimulus *stimulus, int yes_key)
 {
-public:
-    int font_size = 20;
-    int word_index;
-    int color_index;
-
-    vector<word_color> wc = {
-        word_color("Gray", GRAY),
-        word_color("Yellow", YELLOW),
-        word_color("Gold", GOLD),
-        word_color("Orange", ORANGE),
-        word_color("Pink", PINK),
-        word_color("Red", RED),
-        word_color("Maroon", MAROON),
-        word_color("Green", GREEN),
-        word_color("Lime", LIME),
-        word_color("Blue", BLUE),
-        word_color("Purple", PURPLE),
-        word_color("Violet", VIOLET),
-        word_color("Beige", BEIGE),
-        word_color("Brown", BROWN),
-        word_color("White", WHITE),
-        word_color("Black", BLACK),
-        word_color("Magenta", MAGENTA)};
+    int min_intensity = 0, max_intensity = 0;
+    int *intensity = stimulus->intensity(&min_intensity, &max_intensity);
+    if (!stimulus->staircase)
+        stimulus->staircase = new Staircase(intensity, min_intensity, max_intensity);
+    else
+        stimulus->staircase->reset();
+    stimulus->staircase->yes_key = yes_key;
+}
 
-    ColoredWords()
+void delete_from_disk(vector<Stimulus *> *stimuli)
+{
+    system("rm -rf ./files/stimuli/*.json");
+    stimuli->clear();
+}
+Stimulus *stimulus_from_json(const Json::Value &root)
+{
+    if (root["type"] == "Fixing")
     {
-        this->font_size = 20 + rand() % 100;
+        Fixing *f = new Fixing;
+        *f = Fixing::from_json(root);
+        return f;
     }
-    ColoredWords(int font_size)
+    else if (root["type"] == "RandomCircles")
     {
-        this->font_size = font_size;
+        RandomCircles *rc = new RandomCircles;
+        *rc = RandomCircles::from_json(root);
+        return rc;
     }
-    void pick()
+    else if (root["type"] == "ColoredWords")
     {
-        word_index = rand() % wc.size();
-        color_index = rand() % wc.size();
+        ColoredWords *cw = new ColoredWords;
+        *cw = ColoredWords::from_json(root);
+        return cw;
     }
-    void draw() override
+    else if (root["type"] == "Grating")
     {
-        DrawText(wc[word_index].first, middle_x_screen, middle_y_screen, font_size, wc[color_index].second);
+        Grating *g = new Grating;
+        *g = Grating::from_json(root);
+        return g;
     }
-
-    Json::String to_json()
+    else if (root["type"] == "NoiseMask")
     {
-        Json::Value root;
-
-        root["type"] = "ColoredWords";
-        root["font_size"] = this->font_size;
-        root["FPS"] = this->FPS;
-        root["duration"] = this->duration;
-        root["repetitionw"] = this->repetitions;
-        root["random_seed"] = this->random_seed;
-
-        return root.toStyledString();
+        NoiseMask *m = new NoiseMask;
+        *m = NoiseMask::from_json(root);
+        return m;
     }
+    return 0;
+}
 
-    std::string to_string() override
+void load_from_disk(vector<Stimulus *> *stimuli, const char *directory = "files/stimuli")
+{
+    stimuli->clear();
+    for (auto const &dir_entry : std::filesystem::directory_iterator{directory})
     {
-        std::string result = "ColoredWords(" +
-                             std::to_string(this->font_size) + "," +
-                             std::to_string(this->FPS) + "," +
-                             std::to_string(this->duration) + "," +
-                             std::to_string(this->repetitions) + "," +
-                             std::to_string(this->random_seed) +
-                             ")";
-        return result;
-    }
+        if (dir_entry.path().extension() != ".json")
+            continue;
 
-    static ColoredWords from_json(Json::Value root)
-    {
-        ColoredWords *s = new ColoredWords;
+        ifstream input_file(dir_entry.path());
+        Json::Value root;
+        input_file >> root;
+        input_file.close();
 
-        if (root["type"] == "ColoredWords")
-        {
-            s->font_size = root.isMember("font_size") ? root["font_size"].asInt() : 20;
-            s->FPS = root.isMember("FPS") ? root["FPS"].asInt() : 60;
-            s->duration = root.isMember("duration") ? root["duration"].asInt() : 30;
-            s->repetitions = root.isMember("repetition") ? root["repetition"].asInt() : 1;
-            s->random_seed = root.isMember("random_seed") ? root["random_seed"].asInt() : 0;
-            s->pick_once = true;
-        }
-        else
+        Stimulus *stimulus = stimulus_from_json(root);
+        if (stimulus)
         {
-            cerr << "Failed to load file; incorrect type." << endl;
+            stimuli->push_back(stimulus);
+            cout << stimulus->to_string() << endl;
         }
-
-        return *s;
     }
-};
-void delete_from_disk(vector<Stimulus *> *stimuli)
-{
-    system("rm -rf ./files/stimuli/*.json");
-    stimuli->clear();
 }
-void load_from_disk(vector<Stimulus *> *stimuli)
+
+// Re-renders logged sessions headless and as fast as the GPU allows, and
+// compares every frame hash with the live run. path is a session log or a
+// directory of them. When export_frame is not negative, that frame (counted
+// from the start of each session) is written next to the log as a PNG.
+bool replay_sessions(const char *path, int export_frame)
 {
-    stimuli->clear();
-    for (auto const &dir_entry : std::filesystem::directory_iterator{"files/stimuli"})
+    vector<filesystem::path> logs = {};
+    if (filesystem::is_directory(path))
+    {
+        for (auto const &dir_entry : filesystem::directory_iterator{path})
+            if (dir_entry.path().extension() == ".json")
+                logs.push_back(dir_entry.path());
+        sort(logs.begin(), logs.end());
+    }
+    else
     {
+        logs.push_back(path);
+    }
 
-        ifstream input_file(dir_entry.path());
+    RenderTexture2D target = LoadRenderTexture(screen_width, screen_height);
+    vector<uint64_t> hashes = {};
+    vector<int> counts = {};
+    size_t failed = 0;
+
+    for (const filesystem::path &log : logs)
+    {
+        session_time t_start = session_clock.now();
+        ifstream input_file(log);
         Json::Value root;
         input_file >> root;
         input_file.close();
 
-        if (root.isMember("type"))
+        if (root.get("version", 1).asInt() != session_log_version)
+        {
+            cerr << log.filename().string() << ": log version " << root.get("version", 1).asInt()
+                 << " cannot be replayed by this build (version " << session_log_version << ")" << endl;
+            failed++;
+            continue;
+        }
+
+        size_t frames = 0, mismatches = 0;
+        for (const Json::Value &presentation : root["presentations"])
         {
-            if (root["type"] == "Fixing")
+            Stimulus *stimulus = stimulus_from_json(presentation["stimulus"]);
+            if (!stimulus)
             {
-                Fixing *f = new Fixing;
-                *f = Fixing::from_json(root);
-                stimuli->push_back(f);
-                cout << f->to_string() << endl;
+                mismatches++;
+                continue;
             }
-            else if (root["type"] == "RandomCircles")
+
+            counts.clear();
+            size_t total = 0;
+            for (const Json::Value &count : presentation["frames"])
+            {
+                counts.push_back(count.asInt());
+                total += count.asInt();
+            }
+
+            // The hashes cover everything draw() reads, so checking them
+            // needs no rasterization; only an exported frame is drawn.
+            stimulus->replay(counts, &hashes, 0);
+
+            const string hex = presentation["hashes"].asString();
+            for (size_t f = 0; f < hashes.size(); f++)
             {
-                RandomCircles *rc = new RandomCircles;
-                *rc = RandomCircles::from_json(root);
-                stimuli->push_back(rc);
-                cout << rc->to_string() << endl;
+                uint64_t logged = f * 16 + 16 <= hex.size() ? strtoull(hex.substr(f * 16, 16).c_str(), 0, 16) : 0;
+                if (hashes[f] != logged && mismatches++ < 10)
+                    cerr << log.filename().string() << ": frame " << frames + f << " of " << stimulus->to_string() << " differs" << endl;
             }
-            else if (root["type"] == "ColoredWords")
+            if (hashes.size() * 16 != hex.size())
+                mismatches++;
+
+            if (export_frame >= (int64_t)frames && export_frame < (int64_t)(frames + total))
             {
-                ColoredWords *cw = new ColoredWords;
-                *cw = ColoredWords::from_json(root);
-                stimuli->push_back(cw);
-                cout << cw->to_string() << endl;
+                // Replays up to the requested frame, which is then left in the target.
+                vector<int> partial = {};
+                int remaining = export_frame - frames + 1;
+                for (int count : counts)
+                {
+                    partial.push_back(min(count, remaining));
+                    remaining -= partial.back();
+                    if (remaining <= 0)
+                        break;
+                }
+                stimulus->replay(partial, &hashes, &target);
+                Image image = LoadImageFromTexture(target.texture);
+                ImageFlipVertical(&image);
+                string image_path = log.parent_path().string() + "/" + log.stem().string() + "_frame_" + std::to_string(export_frame) + ".png";
+                ExportImage(image, image_path.c_str());
+                UnloadImage(image);
+                cout << "Exported " << image_path << endl;
             }
+
+            frames += total;
+            delete stimulus;
         }
+
+        cout << log.filename().string() << ": " << root["presentations"].size() << " presentations, " << frames << " frames, "
+             << (mismatches ? std::to_string(mismatches) + " mismatches" : "ok") << " in "
+             << TimeBase::to_ms(session_clock.now() - t_start) << " ms" << endl;
+        if (mismatches)
+            failed++;
     }
+
+    UnloadRenderTexture(target);
+    cout << logs.size() - failed << " of " << logs.size() << " sessions verified" << endl;
+    return failed == 0;
 }
 
 #define COLOR_ACCENT ColorFromHSV(225, 0.75, 0.8)
@@ -490,7 +3403,7 @@ typedef enum
     BS_CLICKED = 2,   // 10
 } Button_State;
 
-static void stimuli_panel(vector<Stimulus *> stimuli, int *selected_index, Rectangle panel_boundary)
+static void stimuli_panel(const vector<Stimulus *> &stimuli, int *selected_index, Rectangle panel_boundary)
 {
 
     auto button_with_id = [selected_index](uint64_t id, Rectangle boundary)
@@ -543,6 +3456,9 @@ static void stimuli_panel(vector<Stimulus *> stimuli, int *selected_index, Recta
         panel_scroll = max_scroll;
     float panel_padding = item_size * 0.1;
 
+    static vector<pair<size_t, Rectangle>> labels = {};
+    labels.clear();
+
     BeginScissorMode(panel_boundary.x, panel_boundary.y, panel_boundary.width, panel_boundary.height);
     for (size_t i = 0; i < stimuli.size(); i++)
     {
@@ -552,6 +3468,9 @@ static void stimuli_panel(vector<Stimulus *> stimuli, int *selected_index, Recta
             .width = panel_boundary.width - panel_padding * 2 - scroll_bar_width,
             .height = item_size - panel_padding * 2,
         };
+        // Only visible rows are laid out and labelled.
+        if (item_boundary.y + item_boundary.height < panel_boundary.y || item_boundary.y > panel_boundary.y + panel_boundary.height)
+            continue;
         Color color;
         if ((i != *selected_index))
         {
@@ -575,20 +3494,27 @@ static void stimuli_panel(vector<Stimulus *> stimuli, int *selected_index, Recta
         }
 
         DrawRectangleRounded(item_boundary, 0.2, 20, color);
+        labels.push_back(make_pair(i, item_boundary));
+    }
 
+    // Labels go after the buttons, all in one text shader pass.
+    text_font.begin();
+    for (auto &[i, item_boundary] : labels)
+    {
         string aux = stimuli[i]->to_string();
         const char *text = aux.c_str();
 
         float fontSize = item_boundary.height * 0.5;
         float text_padding = item_boundary.width * 0.05;
-        Vector2 size = MeasureTextEx(font, text, fontSize, 0);
+        Vector2 size = text_font.measure(text, fontSize);
         Vector2 position = {
             .x = item_boundary.x + text_padding,
             .y = item_boundary.y + item_boundary.height * 0.333 - size.y * 0.5,
         };
 
-        DrawTextEx(font, text, position, fontSize, 0, WHITE);
+        text_font.draw(text, position, fontSize, WHITE);
     }
+    text_font.end();
 
     if (entire_scrollable_area > visible_area_size)
     {
@@ -652,9 +3578,253 @@ void checkIs()
     cout << "is_presenting " << is_presenting << endl;
 }
 
-int main(void)
+// Runs body repeatedly for at least min_time and reports the mean time per
+// call. Logging done by the code under test is discarded while it runs.
+void benchmark(const char *name, function<void()> body, session_time min_time = chrono::milliseconds(200))
+{
+    streambuf *out = cout.rdbuf(nullptr);
+
+    // Time the clock once per batch so it does not dominate cheap bodies.
+    session_time t_warmup = session_clock.now();
+    body();
+    long warmup = max((int64_t)1, (session_clock.now() - t_warmup).count());
+    long batch = max(1L, min(10000L, 1000000L / warmup));
+
+    long iterations = 0;
+    session_time t_start = session_clock.now();
+    session_time elapsed;
+    do
+    {
+        for (long b = 0; b < batch; b++)
+            body();
+        iterations += batch;
+        elapsed = session_clock.now() - t_start;
+    } while (elapsed < min_time);
+
+    cout.rdbuf(out);
+    cout.clear();
+    cout << left << setw(36) << name << right << setw(14) << fixed << setprecision(1)
+         << (double)elapsed.count() / iterations << " ns/op" << setw(10) << iterations << " runs" << endl;
+}
+
+vector<Stimulus *> synthetic_stimuli(int count)
+{
+    vector<Stimulus *> stimuli = {};
+    for (int i = 0; i < count; i++)
+    {
+        switch (i % 5)
+        {
+        case 0:
+            stimuli.push_back(new Fixing(20 + i % 100, 400, 400));
+            break;
+        case 1:
+            stimuli.push_back(new RandomCircles(100 + i % 400, 5, 100, 300, 60, 1, 0, i));
+            break;
+        case 2:
+            stimuli.push_back(new ColoredWords(20 + i % 100));
+            break;
+        case 3:
+            stimuli.push_back(new Grating(256, 4 + i % 8, i % 180, 100, 40, i % 3));
+            break;
+        default:
+            stimuli.push_back(new NoiseMask(256, 1 + i % 8, 100, 1));
+            break;
+        }
+        stimuli.back()->random_seed = i;
+    }
+    return stimuli;
+}
+
+// Headless microbenchmarks of the stimulus hot paths (./s --bench).
+void run_benchmarks()
+{
+    RenderTexture2D target = LoadRenderTexture(screen_width, screen_height);
+
+    Fixing fixing(70, 400, 400);
+    RandomCircles circles(1000, 5, 100, 300, 60, 1, 0, 0);
+    ColoredWords words(80);
+    Grating grating(256, 8, 45, 100, 40, 2);
+    NoiseMask noise(256, 4, 100, 8);
+    vector<Stimulus *> types = {&fixing, &circles, &words, &grating, &noise};
+
+    for (Stimulus *s : types)
+    {
+        s->prepare();
+        s->pick_frame(0, 1);
+    }
+
+    for (Stimulus *s : types)
+    {
+        string name = s->to_string();
+        name = name.substr(0, name.find('('));
+
+        int index = 0;
+        benchmark((name + "::pick").c_str(), [s, &index]()
+                  { s->pick_frame(0, ++index); });
+        benchmark((name + "::draw").c_str(), [s, target]()
+                  {
+            BeginTextureMode(target);
+            ClearBackground(s->background);
+            s->draw();
+            EndTextureMode(); });
+        benchmark((name + "::to_json").c_str(), [s]()
+                  { s->to_json(); });
+        benchmark((name + "::to_string").c_str(), [s]()
+                  { s->to_string(); });
+    }
+
+    Json::Value root;
+    Json::Reader reader;
+    reader.parse(fixing.to_json(), root);
+    benchmark("Fixing::from_json", [root]()
+              { Fixing::from_json(root); });
+    reader.parse(circles.to_json(), root);
+    benchmark("RandomCircles::from_json", [root]()
+              { RandomCircles::from_json(root); });
+    reader.parse(words.to_json(), root);
+    benchmark("ColoredWords::from_json", [root]()
+              { ColoredWords::from_json(root); });
+    reader.parse(grating.to_json(), root);
+    benchmark("Grating::from_json", [root]()
+              { Grating::from_json(root); });
+    reader.parse(noise.to_json(), root);
+    benchmark("NoiseMask::from_json", [root]()
+              { NoiseMask::from_json(root); });
+
+    vector<Stimulus *> library = synthetic_stimuli(10000);
+    int selected = 0;
+    benchmark("stimuli_panel(10000)", [&]()
+              {
+        BeginTextureMode(target);
+        stimuli_panel(library, &selected, (Rectangle){.x = 0, .y = 30, .width = 300, .height = 400});
+        EndTextureMode(); });
+
+    TrialSequence sequence;
+    sequence.repeats = 2000;
+    sequence.blocks = 2;
+    vector<Stimulus *> conditions(library.begin(), library.begin() + 5);
+    benchmark("TrialSequence::generate(10000)", [&]()
+              { sequence.generate(conditions); });
+
+    vector<Staircase> staircases = {};
+    int intensities[4] = {};
+    for (int i = 0; i < 4; i++)
+        staircases.push_back(Staircase(&intensities[i], 1, 1000));
+    int response = 0;
+    benchmark("Staircase::update x4", [&]()
+              {
+                  for (Staircase &staircase : staircases)
+                  {
+                      staircase.apply();
+                      staircase.update(++response % 3 != 0);
+                  }
+                  if (staircases[0].trials > 200)
+                      for (Staircase &staircase : staircases)
+                          staircase.reset();
+              });
+
+    const char *directory = "./files/bench/stimuli";
+    filesystem::create_directories(directory);
+    for (size_t i = 0; i < 1000; i++)
+    {
+        ofstream file = ofstream(string(directory) + "/" + std::to_string(i) + ".json", ios::out);
+        file << library[i]->to_json();
+        file.close();
+    }
+    // Freed inside the timed body, so every iteration starts from the same heap.
+    vector<Stimulus *> loaded = {};
+    benchmark("load_from_disk(1000)", [&]()
+              {
+        load_from_disk(&loaded, directory);
+        for (Stimulus *stimulus : loaded)
+            delete stimulus; });
+    filesystem::remove_all("./files/bench");
+
+    UnloadRenderTexture(target);
+}
+
+// Deterministic workload for profile-guided builds (./s --train): it runs
+// the presentation frame loop of every stimulus type plus the library and
+// sequencing code paths, with fixed seeds and without user input.
+void run_training()
+{
+    vector<Stimulus *> library = synthetic_stimuli(200);
+    for (Stimulus *s : library)
+    {
+        s->FPS = 1000;
+        s->duration = 1;
+        s->repetitions = 0;
+        s->to_json();
+        s->to_string();
+    }
+
+    TrialSequence sequence;
+    sequence.repeats = 2;
+    sequence.blocks = 5;
+    for (int p = 0; p < 10; p++)
+    {
+        sequence.participant = p;
+        sequence.generate(library);
+    }
+
+    vector<Stimulus *> conditions(library.begin(), library.begin() + 10);
+    sequence.repeats = 1;
+    sequence.blocks = 1;
+    vector<Trial> trials = sequence.generate(conditions);
+    for (Trial &t : trials)
+        t.run();
+
+    int selected = 0;
+    for (int f = 0; f < 600; f++)
+    {
+        BeginDrawing();
+        ClearBackground(RAYWHITE);
+        stimuli_panel(library, &selected, (Rectangle){.x = 0, .y = 30, .width = 300, .height = 400});
+        EndDrawing();
+    }
+}
+
+int main(int argc, char **argv)
 {
+    bool is_bench = false;
+    bool is_train = false;
+    bool is_alloc_check = false;
+    bool is_control = false;
+    const char *replay_path = 0;
+    int replay_frame = -1;
+
+    for (int a = 1; a < argc; a++)
+    {
+        if (string(argv[a]) == "--tsc")
+            session_clock.calibrate_tsc();
+        else if (string(argv[a]) == "--bench")
+            is_bench = true;
+        else if (string(argv[a]) == "--train")
+            is_train = true;
+        else if (string(argv[a]) == "--alloc-check")
+            is_alloc_check = true;
+        else if (string(argv[a]) == "--markers")
+            markers.open(true);
+        else if (string(argv[a]) == "--markers-socket")
+            markers.open(false);
+        else if (string(argv[a]) == "--markers-consume")
+        {
+            consume_markers();
+            return EXIT_SUCCESS;
+        }
+        else if (string(argv[a]) == "--markers-bench")
+            return benchmark_markers() ? EXIT_SUCCESS : EXIT_FAILURE;
+        else if (string(argv[a]) == "--control")
+            is_control = true;
+        else if (string(argv[a]) == "--replay" && a + 1 < argc)
+            replay_path = argv[++a];
+        else if (string(argv[a]) == "--replay-frame" && a + 1 < argc)
+            replay_frame = atoi(argv[++a]);
+    }
+
     // Setting raylib variables
+    bool is_headless = is_bench || is_train || is_alloc_check || replay_path;
+    SetConfigFlags(is_headless ? FLAG_WINDOW_HIDDEN : FLAG_VSYNC_HINT);
     InitWindow(screen_width, screen_height, "Stimulus");
     SetTargetFPS(screen_FPS);
 
@@ -662,9 +3832,46 @@ int main(void)
     filesystem::create_directories("./files/stimuli");
     filesystem::create_directories("./files/experiments");
     filesystem::create_directories("./files/people");
+    filesystem::create_directories("./files/fonts");
+    filesystem::create_directories("./files/sessions");
+
+    text_font.load(sdf_font_path);
+
+    if (replay_path)
+    {
+        bool passed = replay_sessions(replay_path, replay_frame);
+        text_font.unload();
+        CloseWindow();
+        return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if (is_headless)
+    {
+        bool passed = true;
+        if (is_bench)
+            run_benchmarks();
+        else
+            run_training();
+        if (is_alloc_check)
+            passed = allocation_tracker.report();
+        frame_pipeline.stop();
+        text_font.unload();
+        CloseWindow();
+        return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    display.measure();
+    SetTargetFPS(screen_FPS);
+
+    // Only the interactive program takes commands.
+    if (is_control)
+        control.start();
 
     vector<Stimulus *> stimuli = {};
     vector<Stimulus *> exp_stimuli = {};
+    vector<Trial> exp_trials = {};
+
+    TrialSequence sequence;
 
     load_from_disk(&stimuli);
 
@@ -691,13 +3898,93 @@ int main(void)
 
     Stim current_stimulus_type = RANDOM_CIRCLES;
 
+    int control_start_client = -1;
+    ControlCommand command;
+
     while (!should_close)
     {
+        session_clock.tick();
         frame_count++;
         GuiSetStyle(DEFAULT, TEXT_SIZE, font_size);
         SetExitKey(KEY_NULL);
         should_close = WindowShouldClose();
 
+        control.status_screen = current_screen;
+        control.status_library = stimuli.size();
+        control.status_experiment = exp_stimuli.size();
+        control.status_trials = exp_trials.size();
+
+        // Remote commands are applied here, between frames of the main screens.
+        while ((current_screen == LOGO || current_screen == MAIN) && control.next(&command))
+        {
+            current_screen = MAIN;
+            int arg = command.args.empty() ? -1 : command.args[0];
+
+            if (command.name == "LOAD")
+            {
+                load_from_disk(&stimuli);
+                left_stimulus_index = 0;
+                control.reply(command.client, "OK " + std::to_string(stimuli.size()));
+            }
+            else if (command.name == "ADD" && arg >= 0 && arg < (int)stimuli.size())
+            {
+                exp_stimuli.push_back(stimuli[arg]);
+                exp_trials.clear();
+                control.reply(command.client, "OK " + std::to_string(exp_stimuli.size()));
+            }
+            else if (command.name == "REMOVE" && arg >= 0 && arg < (int)exp_stimuli.size())
+            {
+                exp_stimuli.erase(exp_stimuli.begin() + arg);
+                right_stimulus_index = 0;
+                exp_trials.clear();
+                control.reply(command.client, "OK " + std::to_string(exp_stimuli.size()));
+            }
+            else if (command.name == "CLEAR")
+            {
+                exp_stimuli.clear();
+                exp_trials.clear();
+                right_stimulus_index = 0;
+                control.reply(command.client, "OK 0");
+            }
+            else if (command.name == "SEQUENCE" && arg >= 0)
+            {
+                sequence.participant = arg;
+                if (command.args.size() > 1)
+                    sequence.repeats = command.args[1];
+                if (command.args.size() > 2)
+                    sequence.blocks = command.args[2];
+                if (command.args.size() > 3)
+                    sequence.max_run = command.args[3];
+                if (command.args.size() > 4)
+                    sequence.max_congruency_run = command.args[4];
+                exp_trials = sequence.generate(exp_stimuli);
+                sequence.save(exp_trials);
+                control.reply(command.client, "OK " + std::to_string(exp_trials.size()));
+            }
+            else if (command.name == "STAIRCASE" && arg >= 0 && arg < (int)exp_stimuli.size())
+            {
+                attach_staircase(exp_stimuli[arg], command.args.size() > 1 ? command.args[1] : KEY_Y);
+                control.reply(command.client, "OK " + std::to_string(exp_stimuli[arg]->staircase->threshold()));
+            }
+            else if (command.name == "START")
+            {
+                is_presenting = true;
+                is_editting = false;
+                current_screen = PRESENTING;
+                control_start_client = command.client;
+                control.reply(command.client, "OK started", false);
+            }
+            else if (command.name == "QUIT")
+            {
+                should_close = true;
+                control.reply(command.client, "OK");
+            }
+            else
+            {
+                control.reply(command.client, "ERR " + command.name);
+            }
+        }
+
         BeginDrawing();
         ClearBackground(RAYWHITE);
 
@@ -713,7 +4000,7 @@ int main(void)
         {
         case LOGO:
         {
-            DrawText("Stimuli", 5, screen_height - 50, 50, LIGHTGRAY);
+            text_font.draw("Stimuli", (Vector2){5, screen_height - 50}, 50, LIGHTGRAY);
             skip_count++;
             if (IsKeyPressed(KEY_ENTER) || skip_count > logo_time * screen_FPS)
             {
@@ -724,7 +4011,7 @@ int main(void)
         }
         case MAIN:
         {
-            DrawText("Main", 5, screen_height - 50, 50, LIGHTGRAY);
+            text_font.draw("Main", (Vector2){5, screen_height - 50}, 50, LIGHTGRAY);
             skip_count++;
 
             stimuli_panel(stimuli,
@@ -751,6 +4038,7 @@ int main(void)
                 cout << "Current left is " << left_stimulus << endl;
                 cout << left_stimulus->to_json() << endl;
                 exp_stimuli.push_back(left_stimulus);
+                exp_trials.clear();
             }
 
             if (IsKeyPressed(KEY_D))
@@ -759,9 +4047,27 @@ int main(void)
                 {
                     exp_stimuli.erase(exp_stimuli.begin() + right_stimulus_index);
                     right_stimulus_index = 0;
+                    exp_trials.clear();
                 }
             }
 
+            if (IsKeyDown(KEY_LEFT_CONTROL) && IsKeyPressed(KEY_R))
+            {
+                session_time t_start = session_clock.now();
+                exp_trials = sequence.generate(exp_stimuli);
+                cout << "Generated " << exp_trials.size() << " trials for participant " << sequence.participant << " in "
+                     << TimeBase::to_ms(session_clock.now() - t_start) << " ms" << endl;
+                sequence.save(exp_trials);
+                sequence.participant++;
+            }
+
+            if (IsKeyDown(KEY_LEFT_CONTROL) && IsKeyPressed(KEY_Q) && exp_stimuli.size() > 0)
+            {
+                Stimulus *stimulus = exp_stimuli[right_stimulus_index];
+                attach_staircase(stimulus, KEY_Y);
+                cout << "Staircase on " << stimulus->to_string() << ", starting at " << stimulus->staircase->threshold() << endl;
+            }
+
             if (IsKeyDown(KEY_LEFT_CONTROL) && IsKeyPressed(KEY_L))
             {
                 load_from_disk(&stimuli);
@@ -790,98 +4096,183 @@ int main(void)
         }
         case EDITTING:
         {
-            using field = tuple<const char *, int *, int, int>;
+            // name, value, min, max, and what a change to it invalidates
+            using field = tuple<const char *, int *, int, int, int>;
 
             vector<field> fixing_fields = {};
             Fixing *fixing_stim = new Fixing();
 
-            fixing_fields.push_back(make_tuple("font_size", &fixing_stim->font_size, 1, 1000));
-            fixing_fields.push_back(make_tuple("center_x", &fixing_stim->center_x, 1, 1000));
-            fixing_fields.push_back(make_tuple("center_y", &fixing_stim->center_y, 1, 1000));
-            fixing_fields.push_back(make_tuple("FPS", &fixing_stim->FPS, 10, 1000));
-            fixing_fields.push_back(make_tuple("duration", &fixing_stim->duration, 1, 1000));
-            fixing_fields.push_back(make_tuple("seed", &fixing_stim->random_seed, 0, 1000));
+            fixing_fields.push_back(make_tuple("font_size", &fixing_stim->font_size, 1, 1000, DIRTY_RENDER));
+            fixing_fields.push_back(make_tuple("center_x", &fixing_stim->center_x, 1, 1000, DIRTY_RENDER));
+            fixing_fields.push_back(make_tuple("center_y", &fixing_stim->center_y, 1, 1000, DIRTY_RENDER));
+            fixing_fields.push_back(make_tuple("FPS", &fixing_stim->FPS, 10, 1000, DIRTY_FPS));
+            fixing_fields.push_back(make_tuple("duration", &fixing_stim->duration, 1, 1000, DIRTY_NONE));
+            fixing_fields.push_back(make_tuple("seed", &fixing_stim->random_seed, 0, 1000, DIRTY_LAYOUT));
 
             vector<field> rc_fields = {};
             RandomCircles *rc_stim = new RandomCircles();
 
-            rc_fields.push_back(make_tuple("N", &rc_stim->n, 1, 1000));
-            rc_fields.push_back(make_tuple("size", &rc_stim->size, 1, 1000));
-            rc_fields.push_back(make_tuple("inner", &rc_stim->inner_radius, 1, 1000));
-            rc_fields.push_back(make_tuple("outter", &rc_stim->outter_radius, 1, 1000));
-            rc_fields.push_back(make_tuple("FPS", &rc_stim->FPS, 10, 1000));
-            rc_fields.push_back(make_tuple("duration", &rc_stim->duration, 1, 1000));
-            rc_fields.push_back(make_tuple("seed", &rc_stim->random_seed, 0, 1000));
+            rc_fields.push_back(make_tuple("N", &rc_stim->n, 1, 1000, DIRTY_LAYOUT));
+            rc_fields.push_back(make_tuple("size", &rc_stim->size, 1, 1000, DIRTY_RENDER));
+            rc_fields.push_back(make_tuple("inner", &rc_stim->inner_radius, 1, 1000, DIRTY_LAYOUT));
+            rc_fields.push_back(make_tuple("outter", &rc_stim->outter_radius, 1, 1000, DIRTY_LAYOUT));
+            rc_fields.push_back(make_tuple("FPS", &rc_stim->FPS, 10, 1000, DIRTY_FPS));
+            rc_fields.push_back(make_tuple("duration", &rc_stim->duration, 1, 1000, DIRTY_NONE));
+            rc_fields.push_back(make_tuple("seed", &rc_stim->random_seed, 0, 1000, DIRTY_LAYOUT));
 
             vector<field> cw_fields = {};
             ColoredWords *cw_stim = new ColoredWords();
 
-            cw_fields.push_back(make_tuple("font_size", &cw_stim->font_size, 1, 100));
-            cw_fields.push_back(make_tuple("FPS", &cw_stim->FPS, 10, 1000));
-            cw_fields.push_back(make_tuple("duration", &cw_stim->duration, 1, 1000));
-            cw_fields.push_back(make_tuple("seed", &cw_stim->random_seed, 0, 1000));
+            cw_fields.push_back(make_tuple("font_size", &cw_stim->font_size, 1, 100, DIRTY_RENDER));
+            cw_fields.push_back(make_tuple("FPS", &cw_stim->FPS, 10, 1000, DIRTY_FPS));
+            cw_fields.push_back(make_tuple("duration", &cw_stim->duration, 1, 1000, DIRTY_NONE));
+            cw_fields.push_back(make_tuple("seed", &cw_stim->random_seed, 0, 1000, DIRTY_LAYOUT));
+
+            vector<field> gr_fields = {};
+            Grating *gr_stim = new Grating();
+
+            gr_fields.push_back(make_tuple("size", &gr_stim->size, 16, 800, DIRTY_LAYOUT));
+            gr_fields.push_back(make_tuple("cycles", &gr_stim->cycles, 0, 100, DIRTY_LAYOUT));
+            gr_fields.push_back(make_tuple("angle", &gr_stim->orientation, 0, 359, DIRTY_LAYOUT));
+            gr_fields.push_back(make_tuple("contrast", &gr_stim->contrast, 0, 100, DIRTY_LAYOUT));
+            gr_fields.push_back(make_tuple("sigma", &gr_stim->sigma, 0, 400, DIRTY_LAYOUT));
+            gr_fields.push_back(make_tuple("drift", &gr_stim->drift, 0, 30, DIRTY_LAYOUT));
+            gr_fields.push_back(make_tuple("FPS", &gr_stim->FPS, 10, 1000, DIRTY_LAYOUT | DIRTY_FPS));
+            gr_fields.push_back(make_tuple("duration", &gr_stim->duration, 1, 1000, DIRTY_NONE));
+
+            vector<field> nm_fields = {};
+            NoiseMask *nm_stim = new NoiseMask();
+
+            nm_fields.push_back(make_tuple("size", &nm_stim->size, 16, 800, DIRTY_LAYOUT));
+            nm_fields.push_back(make_tuple("grain", &nm_stim->grain, 1, 64, DIRTY_LAYOUT));
+            nm_fields.push_back(make_tuple("contrast", &nm_stim->contrast, 0, 100, DIRTY_LAYOUT));
+            nm_fields.push_back(make_tuple("frames", &nm_stim->ring, 1, 240, DIRTY_LAYOUT));
+            nm_fields.push_back(make_tuple("FPS", &nm_stim->FPS, 10, 1000, DIRTY_FPS));
+            nm_fields.push_back(make_tuple("duration", &nm_stim->duration, 1, 1000, DIRTY_NONE));
+            nm_fields.push_back(make_tuple("seed", &nm_stim->random_seed, 0, 1000, DIRTY_LAYOUT));
 
             int f_current = 0;
             bool show_FPS = true;
 
             Stim editting_type = RANDOM_CIRCLES;
+            Stim previous_type = editting_type;
 
-            fixing_stim->pick();
+            // The preview is rendered into a texture only when a field it
+            // depends on changes, and the texture is blitted otherwise.
+            RenderTexture2D preview = LoadRenderTexture(screen_width, screen_height);
+            vector<int> field_values = {};
+            int dirty = DIRTY_ALL;
+            int preview_index = 0; // frame of the first repetition on show
 
             while (is_editting)
             {
+                session_clock.tick();
                 BeginDrawing();
                 ClearBackground(RAYWHITE);
 
-                if (show_FPS)
-                    DrawFPS(10, 10);
-
                 if (IsKeyPressed(KEY_F))
                 {
                     show_FPS = !show_FPS;
                 }
 
-                SetTargetFPS(fixing_stim->FPS);
-
                 Stimulus *editting_stimulus = 0;
 
-                vector<field> field_vector;
+                vector<field> *field_vector = 0;
                 Stim next_editting_type;
                 switch (editting_type)
                 {
                 case FIXING:
                     editting_stimulus = fixing_stim;
-                    field_vector = fixing_fields;
+                    field_vector = &fixing_fields;
                     next_editting_type = COLORED_WORDS;
-                    editting_stimulus->pick_once = true;
                     break;
                 case COLORED_WORDS:
                     editting_stimulus = cw_stim;
-                    field_vector = cw_fields;
+                    field_vector = &cw_fields;
                     next_editting_type = RANDOM_CIRCLES;
-                    editting_stimulus->pick_once = true;
+                    break;
+                case GRATING:
+                    editting_stimulus = gr_stim;
+                    field_vector = &gr_fields;
+                    next_editting_type = NOISE_MASK;
+                    break;
+                case NOISE_MASK:
+                    editting_stimulus = nm_stim;
+                    field_vector = &nm_fields;
+                    next_editting_type = FIXING;
                     break;
                 default:
                     editting_stimulus = rc_stim;
-                    field_vector = rc_fields;
-                    next_editting_type = FIXING;
-                    editting_stimulus->pick_once = false;
+                    field_vector = &rc_fields;
+                    next_editting_type = GRATING;
                     break;
                 }
 
+                if (editting_type != previous_type || field_values.size() != field_vector->size())
+                {
+                    previous_type = editting_type;
+                    field_values.assign(field_vector->size(), INT_MIN);
+                    dirty = DIRTY_ALL;
+                }
+                for (size_t f = 0; f < field_vector->size(); f++)
+                {
+                    int value = *get<1>((*field_vector)[f]);
+                    if (value != field_values[f])
+                    {
+                        field_values[f] = value;
+                        dirty |= get<4>((*field_vector)[f]);
+                    }
+                }
+
                 if (IsKeyDown(KEY_LEFT_CONTROL) && IsKeyPressed(KEY_ENTER))
                     editting_type = next_editting_type;
 
-                if (!editting_stimulus->pick_once || IsKeyPressed(KEY_SPACE))
-                    editting_stimulus->pick();
-                editting_stimulus->draw();
+                if (IsKeyPressed(KEY_SPACE))
+                {
+                    // The next frame's pick.
+                    editting_stimulus->pick_frame(0, ++preview_index);
+                    dirty |= DIRTY_RENDER;
+                }
+
+                if (dirty & DIRTY_FPS)
+                    SetTargetFPS(editting_stimulus->FPS);
+
+                if ((dirty & DIRTY_LAYOUT) == DIRTY_LAYOUT)
+                {
+                    // The first frame a presentation would show.
+                    preview_index = editting_stimulus->pick_once ? 0 : 1;
+                    editting_stimulus->prepare();
+                    editting_stimulus->pick_frame(0, preview_index);
+                }
+                else if ((editting_type == GRATING || editting_type == NOISE_MASK) && !editting_stimulus->pick_once)
+                {
+                    // Drifting gratings and dynamic noise step through their frame ring;
+                    // circles and words are only laid out again on Space or a field change.
+                    editting_stimulus->pick_frame(0, ++preview_index);
+                    dirty |= DIRTY_RENDER;
+                }
+
+                if (dirty & DIRTY_RENDER)
+                {
+                    BeginTextureMode(preview);
+                    ClearBackground(editting_stimulus->background);
+                    editting_stimulus->draw();
+                    EndTextureMode();
+                }
+                dirty = DIRTY_NONE;
+
+                // Render textures are stored bottom-up.
+                DrawTextureRec(preview.texture, (Rectangle){0, 0, (float)preview.texture.width, (float)-preview.texture.height}, (Vector2){0, 0}, WHITE);
+
+                if (show_FPS)
+                    DrawFPS(10, 10);
 
                 float field_height = 0;
                 int field_count = 0;
 
-                int field_index = f_current % field_vector.size();
+                int field_index = f_current % field_vector->size();
 
-                for (field f : field_vector)
+                for (const field &f : *field_vector)
                 {
                     GuiValueBox(
                         (Rectangle){600, 140 + field_height, 120, 20},
@@ -906,23 +4297,26 @@ int main(void)
                     }
                 }
 
-                cout << field_index << endl;
-
                 if (IsKeyPressed(KEY_UP) || IsKeyDown(KEY_RIGHT))
                 {
-                    if (*get<1>(field_vector[field_index]) < get<3>(field_vector[field_index]))
-                        *get<1>(field_vector[field_index]) += 1;
+                    if (*get<1>((*field_vector)[field_index]) < get<3>((*field_vector)[field_index]))
+                        *get<1>((*field_vector)[field_index]) += 1;
                 }
 
                 if (IsKeyPressed(KEY_DOWN) || IsKeyDown(KEY_LEFT))
                 {
-                    if (*get<1>(field_vector[field_index]) > get<2>(field_vector[field_index]))
-                        *get<1>(field_vector[field_index]) -= 1;
+                    if (*get<1>((*field_vector)[field_index]) > get<2>((*field_vector)[field_index]))
+                        *get<1>((*field_vector)[field_index]) -= 1;
                 }
 
                 if (IsKeyPressed(KEY_S))
                 {
-                    if (IsKeyDown(KEY_LEFT_CONTROL))
+                    if (IsKeyDown(KEY_LEFT_CONTROL) && IsKeyDown(KEY_LEFT_SHIFT))
+                    {
+                        // Every stimulus being edited, one per type, as one batch.
+                        library_writer.save_all({fixing_stim->file(), rc_stim->file(), cw_stim->file(), gr_stim->file(), nm_stim->file()});
+                    }
+                    else if (IsKeyDown(KEY_LEFT_CONTROL))
                     {
                         editting_stimulus->save();
                     }
@@ -935,6 +4329,9 @@ int main(void)
                         delete cw_stim;
                         delete rc_stim;
                         delete fixing_stim;
+                        delete gr_stim;
+                        delete nm_stim;
+                        UnloadRenderTexture(preview);
 
                         is_editting = false;
                     }
@@ -953,19 +4350,44 @@ int main(void)
             cout << &exp_stimuli << endl;
             for (auto s : exp_stimuli)
                 cout << s->to_string() << endl;
+            should_break = false;
+            control.status_screen = PRESENTING;
+            session_log.begin();
             while (is_presenting)
             {
-                for (auto s : exp_stimuli)
+                if (!exp_trials.empty())
                 {
-                    s->present();
+                    for (size_t t = 0; t < exp_trials.size() && !should_break; t++)
+                    {
+                        control.status_trial = t;
+                        exp_trials[t].run();
+                    }
+                }
+                else
+                {
+                    for (size_t s = 0; s < exp_stimuli.size() && !should_break; s++)
+                    {
+                        control.status_trial = s;
+                        exp_stimuli[s]->present();
+                    }
                 }
                 is_presenting = false;
             }
+            control.status_trial = -1;
+            session_log.end();
+            if (control_start_client >= 0)
+            {
+                control.reply(control_start_client, should_break ? "DONE aborted" : "DONE");
+                control_start_client = -1;
+            }
             current_screen = REPORT;
             break;
         }
         case REPORT:
         {
+#ifdef TRACK_ALLOCATIONS
+            allocation_tracker.report();
+#endif
             current_screen = MAIN;
             break;
         }
@@ -976,6 +4398,17 @@ int main(void)
         EndDrawing();
     }
 
+    if (session_clock.use_tsc)
+        cout << "TSC drift from steady_clock before re-anchoring: at most "
+             << session_clock.max_error_ns / 1000.0 << " us" << endl;
+
+    control.stop();
+    frame_pipeline.stop();
+    // A session cut short still leaves its log; it is written with the rest.
+    session_log.end();
+    library_writer.stop();
+    markers.close();
+    text_font.unload();
     CloseWindow();
 
     return EXIT_SUCCESS;